@@ -0,0 +1,51 @@
+#!/bin/bash
+
+# times the vm engines on the programs in input/bench,
+# the instruction counts come from a build with -DVMSTATS
+#
+# every engine is name:cflags:flags, walk is the stack vm
+# following static links instead of using the display and
+# checked runs it with the masking even on verified code,
+# tos keeps the top of the stack out of memory, trace
+# compiles the hot loops, closure runs the code as
+# chains of C functions and split keeps the frame links
+# on a control stack of their own
+engines="thread::- tos::-t switch::-s closure::-n split::-a reg::-r jit::-j trace::-x walk:-DNODISPLAY:- checked:-DNOVERIFY:-"
+
+for e in $engines
+do
+    IFS=: read name cflags flag <<< "$e"
+    cc -O2 $cflags -o pl0.$name src/*.c -Wall -Wextra -pedantic -std=c99 -pthread || exit 1
+    cc -O2 $cflags -DVMSTATS -o pl0.$name.stats src/*.c -Wall -Wextra -pedantic -std=c99 -pthread || exit 1
+done
+
+TIMEFORMAT=%R
+printf "%-20s %-8s %14s %8s\n" program engine dispatches seconds
+for i in input/bench/*.pl0
+do
+    for e in $engines
+    do
+        IFS=: read name cflags flag <<< "$e"
+        n=$(./pl0.$name.stats $flag $i 2>&1 >/dev/null | awk '/dispatched/ {print $2}')
+        n=${n:--}
+        t=$( { time ./pl0.$name $flag $i >/dev/null; } 2>&1 )
+        printf "%-20s %-8s %14s %8s\n" $(basename $i) $name "$n" "$t"
+    done
+done
+
+# startup latency, how long a trivial program takes from
+# start to exit, averaged over a lot of runs
+runs=200
+printf "\n%-20s %-8s %14s\n" startup engine "ms per run"
+for e in $engines
+do
+    IFS=: read name cflags flag <<< "$e"
+    t=$( { time for ((k = 0; k < runs; k++)); do ./pl0.$name $flag input/if.pl0 >/dev/null; done; } 2>&1 )
+    printf "%-20s %-8s %14s\n" if.pl0 $name $(echo "$t $runs" | awk '{printf "%.3f", $1 * 1000 / $2}')
+done
+
+for e in $engines
+do
+    IFS=: read name cflags flag <<< "$e"
+    rm -f pl0.$name pl0.$name.stats
+done
@@ -1,3 +1,3 @@
 #!/bin/sh
 
-cc -o pl0 src/*.c -Wall -Wextra -pedantic -std=c99
+cc -o pl0 src/*.c -Wall -Wextra -pedantic -std=c99 -pthread
@@ -0,0 +1,451 @@
+#include "dat.h"
+#include "fns.h"
+
+/* the C backend, it writes the loaded code out as a C program
+   that does what the vm would running it, build it with
+
+   cc -O2 -pthread -o prog output.c
+
+   every procedure, the main program too, becomes a C function
+   that gets a pointer to its frame, the frames are where the vm
+   would have them on a stack of the same size, so code that reads
+   a variable before it sets it sees the same, the static links
+   get followed once when a procedure starts, into pointers to the
+   frames it uses, and the stack depth at every instruction is
+   known from the verifier, so every push and pop is a fixed slot
+   of the frame, a jump is a goto and a call is a call
+
+   only verified code can be written, the runtime errors and
+   input prompts are the ones of the vm, word for word, and so is
+   the stack overflow, the procedures recurse on a thread with
+   a C stack big enough for as many frames as fit on the vm stack */
+
+static int *own;
+static int *dep;
+static int *up;
+static char *label;
+
+/* the runtime every program gets, before the code */
+static char *prelude[] =
+{
+    "#include <stdio.h>",
+    "#include <stdlib.h>",
+    "#include <string.h>",
+    "#include <pthread.h>",
+    "",
+    "static int stk[LIMIT];",
+    "",
+    "static void die(char *s)",
+    "{",
+    "    fprintf(stderr, \"%s\\n\", s);",
+    "    exit(1);",
+    "}",
+    ""
+};
+
+/* for code that calls */
+static char *rtcall[] =
+{
+    "static void overflow(int pc)",
+    "{",
+    "    fprintf(stderr, \"vm: stack overflow at pc %d\\n\", pc);",
+    "    exit(1);",
+    "}",
+    ""
+};
+
+/* and for code that reads */
+static char *rtread[] =
+{
+    "static int readin(void)",
+    "{",
+    "    char buf[16], *p;",
+    "    int i, j, mul;",
+    "",
+    "loop:",
+    "    fprintf(stdout, \"Enter a value to be placed on top of the stack: \");",
+    "    if (!fgets(buf, sizeof(buf), stdin))",
+    "    {",
+    "        if (feof(stdin))",
+    "            die(\"vm: out of input\");",
+    "        fprintf(stderr, \"Invalid input, try again\\n\");",
+    "        goto loop;",
+    "    }",
+    "",
+    "    i = 0;",
+    "    while ((p = strchr(buf, '\\n')) == NULL)",
+    "    {",
+    "        if (feof(stdin) || !fgets(buf, sizeof(buf), stdin))",
+    "        {",
+    "            p = buf + strlen(buf);",
+    "            break;",
+    "        }",
+    "        i = 1;",
+    "    }",
+    "    if (i)",
+    "    {",
+    "        fprintf(stderr, \"Input too long, try again\\n\");",
+    "        goto loop;",
+    "    }",
+    "",
+    "    *p = '\\0';",
+    "    if (buf[0] == '\\0')",
+    "    {",
+    "        fprintf(stderr, \"No input entered, try again\\n\");",
+    "        goto loop;",
+    "    }",
+    "",
+    "    mul = 1;",
+    "    i = 0;",
+    "    while (buf[i] == '+' || buf[i] == '-')",
+    "    {",
+    "        mul = (buf[i] == '+') ? 1 : -1;",
+    "        i++;",
+    "    }",
+    "    p = &buf[i];",
+    "",
+    "    j = 0;",
+    "    for (; buf[i] != '\\0'; i++, j++)",
+    "    {",
+    "        if (j > MAX_DIGIT)",
+    "        {",
+    "            fprintf(stderr, \"Input too long, enter a shorter number\\n\");",
+    "            goto loop;",
+    "        }",
+    "",
+    "        if (!(('0' <= buf[i]) && (buf[i] <= '9')))",
+    "        {",
+    "            fprintf(stderr, \"Input contains non-numbered characters, try again\\n\");",
+    "            goto loop;",
+    "        }",
+    "    }",
+    "",
+    "    return atoi(p) * mul;",
+    "}",
+    ""
+};
+
+/* and after it, p0 is the main program */
+static char *postlude[] =
+{
+    "static void *run(void *arg)",
+    "{",
+    "    (void)arg;",
+    "    p0(stk + 1);",
+    "    return NULL;",
+    "}",
+    "",
+    "int main(void)",
+    "{",
+    "    pthread_attr_t a;",
+    "    pthread_t t;",
+    "",
+    "    pthread_attr_init(&a);",
+    "    pthread_attr_setstacksize(&a, (size_t)(LIMIT / 4 + 1) * 128 + (1 << 20));",
+    "    if (pthread_create(&t, &a, run, NULL) != 0)",
+    "        die(\"can't make a thread to run on\");",
+    "    pthread_join(t, NULL);",
+    "    return 0;",
+    "}"
+};
+
+static char *binops[] =
+{
+    [XADD] = "+", [XSUB] = "-", [XMUL] = "*", [XDIV] = "/", [XMOD] = "%",
+    [XEQL] = "==", [XNEQ] = "!=", [XLSS] = "<", [XLEQ] = "<=",
+    [XGTR] = ">", [XGEQ] = ">="
+};
+
+static void lines(FILE *fp, char **s, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+        fprintf(fp, "%s\n", s[i]);
+}
+
+/* does any instruction that can run decode to op */
+static int uses(Ins *ins, int len, int op)
+{
+    int pc;
+
+    for (pc = 0; pc < len; pc++)
+    {
+        if (own[pc] >= 0 && decode(&ins[pc]) == op)
+            return 1;
+    }
+    return 0;
+}
+
+static int pw(int v)
+{
+    return v & (MAX_CODE_LENGTH-1);
+}
+
+static void reach(int *work, int *nwork, int pc, int o, int d)
+{
+    if (own[pc] >= 0)
+        return;
+    own[pc] = o;
+    dep[pc] = d;
+    work[(*nwork)++] = pc;
+}
+
+/* find the procedure every instruction is in, the stack depth
+   there and the jump targets, the verifier already made sure
+   it is the same from every path */
+static void walk(Ins *ins, int len)
+{
+    int *work, nwork, pc, o, d, n;
+    Ins *p;
+
+    work = emalloc(sizeof(work[0]) * (len + 1));
+    nwork = 0;
+    for (pc = 0; pc < len; pc++)
+        own[pc] = -1;
+
+    reach(work, &nwork, 0, 0, 0);
+    while (nwork > 0)
+    {
+        pc = work[--nwork];
+        p = &ins[pc];
+        o = own[pc];
+        d = dep[pc];
+
+        switch (decode(p))
+        {
+            case XRET:
+                continue;
+
+            case XJMP:
+                label[pw(p->m)] = 1;
+                reach(work, &nwork, pw(p->m), o, d);
+                continue;
+
+            case XJPC:
+                d--;
+                label[pw(p->m)] = 1;
+                reach(work, &nwork, pw(p->m), o, d);
+                break;
+
+            case XCAL:
+                n = pw(p->m);
+                reach(work, &nwork, n, n, 0);
+                up[o] = max(up[o], p->l);
+                break;
+
+            case XTCL:
+                n = pw(p->m);
+                if (n == o)
+                    label[n] = 1;
+                reach(work, &nwork, n, n, 0);
+                continue;
+
+            case XLOD:
+            case XSTO:
+                up[o] = max(up[o], p->l);
+                d += (decode(p) == XLOD) ? 1 : -1;
+                break;
+
+            case XINC:
+                d += p->m;
+                break;
+
+            case XLIT:
+            case XSIO2:
+                d++;
+                break;
+
+            case XNEG:
+            case XODD:
+                break;
+
+            default:
+                d--;
+                break;
+        }
+        reach(work, &nwork, pc + 1, o, d);
+    }
+    free(work);
+}
+
+/* the frame l static links out */
+static char *frame(int l)
+{
+    static char buf[16];
+
+    if (l == 0)
+        return "f";
+    snprintf(buf, sizeof(buf), "s%d", l);
+    return buf;
+}
+
+/* one instruction, the top of the stack is at f[d - 1] */
+static void gen(FILE *fp, Ins *p, int pc, int d)
+{
+    int op;
+
+    op = decode(p);
+    switch (op)
+    {
+        case XLIT:
+            fprintf(fp, "    f[%d] = %d;\n", d, p->m);
+            break;
+
+        case XRET:
+            fprintf(fp, "    return;\n");
+            break;
+
+        case XNEG:
+            fprintf(fp, "    f[%d] = -f[%d];\n", d - 1, d - 1);
+            break;
+
+        case XODD:
+            fprintf(fp, "    f[%d] %%= 2;\n", d - 1);
+            break;
+
+        case XDIV:
+        case XMOD:
+            fprintf(fp, "    if (f[%d] == 0)\n", d - 1);
+            fprintf(fp, "        die(\"vm: %s by 0\");\n", (op == XDIV) ? "divide" : "mod");
+            /* fall through */
+        case XADD: case XSUB: case XMUL:
+        case XEQL: case XNEQ: case XLSS: case XLEQ: case XGTR: case XGEQ:
+            fprintf(fp, "    f[%d] = f[%d] %s f[%d];\n", d - 2, d - 2, binops[op], d - 1);
+            break;
+
+        case XLOD:
+            fprintf(fp, "    f[%d] = %s[%d];\n", d, frame(p->l), p->m);
+            break;
+
+        case XSTO:
+            fprintf(fp, "    %s[%d] = f[%d];\n", frame(p->l), p->m, d - 1);
+            break;
+
+        case XCAL:
+            fprintf(fp, "    n = f + %d;\n", d);
+            fprintf(fp, "    n[0] = 0;\n");
+            fprintf(fp, "    n[1] = %s - stk;\n", frame(p->l));
+            fprintf(fp, "    n[2] = f - stk;\n");
+            fprintf(fp, "    n[3] = %d;\n", pc + 1);
+            fprintf(fp, "    if (n - stk + TOP > LIMIT)\n");
+            fprintf(fp, "        overflow(%d);\n", pc);
+            fprintf(fp, "    p%d(n);\n", pw(p->m));
+            break;
+
+        /* the frame and its static link stay, a procedure calling
+           itself starts over, a sibling gets the frame passed on */
+        case XTCL:
+            fprintf(fp, "    f[0] = 0;\n");
+            if (own[pc] == pw(p->m))
+                fprintf(fp, "    goto L%d;\n", pw(p->m));
+            else
+                fprintf(fp, "    p%d(f);\n    return;\n", pw(p->m));
+            break;
+
+        case XJMP:
+            fprintf(fp, "    goto L%d;\n", pw(p->m));
+            break;
+
+        case XJPC:
+            fprintf(fp, "    if (f[%d] == 0)\n", d - 1);
+            fprintf(fp, "        goto L%d;\n", pw(p->m));
+            break;
+
+        case XSIO1:
+            fprintf(fp, "    printf(\"Value on top of the stack: %%d\\n\", f[%d]);\n", d - 1);
+            break;
+
+        case XSIO2:
+            fprintf(fp, "    f[%d] = readin();\n", d);
+            break;
+
+        case XLDS:
+            fprintf(fp, "    f[%d] = f[%d];\n", d - 1 + p->m, d - 1);
+            break;
+    }
+}
+
+static void proc(FILE *fp, Ins *ins, int len, int o)
+{
+    int pc, l, calls;
+
+    calls = 0;
+    for (pc = 0; pc < len; pc++)
+        calls |= own[pc] == o && decode(&ins[pc]) == XCAL;
+
+    fprintf(fp, "\nstatic void p%d(int *f)\n{\n", o);
+    for (l = 1; l <= up[o]; l++)
+        fprintf(fp, "    int *s%d = stk + %s[1];\n", l, (l == 1) ? "f" : frame(l - 1));
+    if (calls)
+        fprintf(fp, "    int *n;\n");
+    if (up[o] > 0 || calls)
+        fprintf(fp, "\n");
+
+    for (pc = 0; pc < len; pc++)
+    {
+        if (own[pc] != o)
+            continue;
+        if (label[pc])
+            fprintf(fp, "L%d:%s\n", pc, (decode(&ins[pc]) == XINC) ? " ;" : "");
+        gen(fp, &ins[pc], pc, dep[pc]);
+    }
+    fprintf(fp, "}\n");
+}
+
+/* write the code of p to f as a C program, returns -1 if it
+   can't because it didn't verify */
+int writec(char *f, Prog *p)
+{
+    FILE *fp;
+    int i, len;
+
+    if (!p->verified)
+    {
+        fprintf(stderr, "%s: the code didn't verify, it can't be written as C\n", f);
+        return -1;
+    }
+
+    fp = fopen(f, "w");
+    if (!fp)
+    {
+        fprintf(stderr, "%s: %s\n", f, strerror(errno));
+        return -1;
+    }
+
+    len = p->inslen;
+    own = emalloc(sizeof(own[0]) * (len + 1));
+    dep = emalloc(sizeof(dep[0]) * (len + 1));
+    up = emalloc(sizeof(up[0]) * (len + 1));
+    label = emalloc(len + 1);
+    walk(p->wide, len);
+
+    fprintf(fp, "/* generated by pl0 from %d instructions */\n\n", len);
+    fprintf(fp, "#define LIMIT     %d\n", stacklimit);
+    fprintf(fp, "#define TOP       %d\n", p->top);
+    fprintf(fp, "#define MAX_DIGIT %d\n\n", MAX_DIGIT);
+    lines(fp, prelude, nelem(prelude));
+    if (uses(p->wide, len, XCAL))
+        lines(fp, rtcall, nelem(rtcall));
+    if (uses(p->wide, len, XSIO2))
+        lines(fp, rtread, nelem(rtread));
+
+    for (i = 0; i < len; i++)
+    {
+        if (own[i] == i)
+            fprintf(fp, "static void p%d(int*);\n", i);
+    }
+    for (i = 0; i < len; i++)
+    {
+        if (own[i] == i)
+            proc(fp, p->wide, len, i);
+    }
+    fprintf(fp, "\n");
+    lines(fp, postlude, nelem(postlude));
+
+    free(own);
+    free(dep);
+    free(up);
+    free(label);
+    return fclose(fp) == 0 ? 0 : -1;
+}
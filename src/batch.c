@@ -0,0 +1,438 @@
+#define _DEFAULT_SOURCE
+#include "dat.h"
+#include "fns.h"
+
+#include <pthread.h>
+#include <unistd.h>
+
+/* the batch runner, it runs a list of jobs in one process
+   over a few threads, a job is a program and the file its
+   input comes from, one per line of the jobs file:
+
+   input/read_write.pl0 five.txt
+   input/if.pl0
+
+   the programs get loaded up front, once each, since the
+   compiler isn't reentrant, a program that doesn't compile
+   stops the whole batch like it would stop a single run,
+   the jobs running the same program share its code, all of
+   what a job prints, errors too, goes to a buffer of its own
+   and the buffers get printed in the order of the jobs at the
+   end, the jobs run on the stack vm whatever the engine
+
+   every job gets a machine of its own and runs SLICE
+   instructions at a time, then goes to the back of the queue of
+   the thread that ran it, a thread that runs out of jobs steals
+   them from the back of the others, so a job that never ends
+   only holds a thread up for a slice at a time, and with -q or
+   -w it gets stopped after that many instructions or ms
+
+   with -u the jobs of the program the snapshot is of start
+   from where it was, every one of them on a clone of a machine
+   the snapshot got loaded into once */
+
+enum
+{
+    JRUN, JOK, JFAIL, JQUOTA, JTIME
+};
+
+static char *jobstate[] =
+{
+    [JRUN]   = "running",
+    [JOK]    = "ok",
+    [JFAIL]  = "failed",
+    [JQUOTA] = "out of fuel",
+    [JTIME]  = "timed out"
+};
+
+typedef struct
+{
+    char     *prog;
+    char     *input;
+    Prog     *code;
+
+    VM       *vm;
+    FILE     *in;
+    FILE     *fout;
+    char     *out;
+    size_t    outlen;
+
+    int       state;
+    long long used;
+    double    start;
+    double    cpu;
+    double    wall;
+} Job;
+
+/* the jobs a thread has to run, a ring of them */
+typedef struct
+{
+    Job           **q;
+    int             head;
+    int             len;
+    pthread_mutex_t lock;
+} Queue;
+
+static Job *jobs;
+static int njobs;
+static Queue *queues;
+static int nqueues;
+static int ndone;
+static int nput;
+static int nidle;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle = PTHREAD_COND_INITIALIZER;
+static VM *warm;
+
+static char *copy(char *s)
+{
+    return strcpy(emalloc(strlen(s) + 1), s);
+}
+
+static void readjobs(char *f)
+{
+    FILE *fp;
+    char buf[1024], prog[512], input[512];
+    int cap, n;
+
+    fp = fopen(f, "r");
+    if (!fp)
+        die("%s: %s", f, strerror(errno));
+
+    cap = 0;
+    while (fgets(buf, sizeof(buf), fp))
+    {
+        n = sscanf(buf, "%511s %511s", prog, input);
+        if (n < 1 || prog[0] == '#')
+            continue;
+
+        if (njobs >= cap)
+        {
+            cap = max(cap * 2, 64);
+            jobs = realloc(jobs, sizeof(jobs[0]) * cap);
+            if (!jobs)
+                die("oom trying to allocate the jobs");
+        }
+        memset(&jobs[njobs], 0, sizeof(jobs[0]));
+        jobs[njobs].prog = copy(prog);
+        jobs[njobs].input = (n > 1) ? copy(input) : NULL;
+        njobs++;
+    }
+    fclose(fp);
+}
+
+/* load every program once, jobs for one that was loaded
+   already share its code */
+static void loadjobs(int vmfile)
+{
+    int i, j;
+
+    for (i = 0; i < njobs; i++)
+    {
+        for (j = 0; j < i; j++)
+        {
+            if (strcmp(jobs[j].prog, jobs[i].prog) == 0)
+                break;
+        }
+        if (j < i)
+        {
+            jobs[i].code = jobs[j].code;
+            continue;
+        }
+
+        if (vmfile)
+            loadinsfile(jobs[i].prog);
+        else
+            compile(jobs[i].prog);
+        jobs[i].code = takeprog();
+    }
+}
+
+/* load the snapshot for the program it is of */
+static void loadwarm(void)
+{
+    int i;
+
+    warm = newvm();
+    for (i = 0; i < njobs; i++)
+    {
+        if (i > 0 && jobs[i].code == jobs[i - 1].code)
+            continue;
+        vmreset(warm, jobs[i].code, stdin, stdout, stderr);
+        if (loadsnap(warm, snapfile) == 0)
+            return;
+    }
+    die("%s: the snapshot is of none of the programs", snapfile);
+}
+
+/* a job gets put on a queue, and a thread that ran out of them
+   gets woken to come steal it, unless it is the only one there,
+   the thread that put it back takes it again next */
+static void put(Queue *q, Job *j)
+{
+    int n;
+
+    pthread_mutex_lock(&q->lock);
+    q->q[(q->head + q->len++) % njobs] = j;
+    n = q->len;
+    pthread_mutex_unlock(&q->lock);
+
+    pthread_mutex_lock(&lock);
+    nput++;
+    if (nidle > 0 && n > 1)
+        pthread_cond_signal(&idle);
+    pthread_mutex_unlock(&lock);
+}
+
+/* the owner takes from the front */
+static Job *take(Queue *q)
+{
+    Job *j;
+
+    j = NULL;
+    pthread_mutex_lock(&q->lock);
+    if (q->len > 0)
+    {
+        j = q->q[q->head];
+        q->head = (q->head + 1) % njobs;
+        q->len--;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return j;
+}
+
+/* and thieves from the back */
+static Job *steal(Queue *q)
+{
+    Job *j;
+
+    j = NULL;
+    pthread_mutex_lock(&q->lock);
+    if (q->len > 0)
+        j = q->q[(q->head + --q->len) % njobs];
+    pthread_mutex_unlock(&q->lock);
+    return j;
+}
+
+/* give j a machine and its files, the first time it runs */
+static int start(Job *j)
+{
+    j->start = clockms(0);
+    j->fout = open_memstream(&j->out, &j->outlen);
+    if (!j->fout)
+        die("batch: %s", strerror(errno));
+
+    j->in = fopen(j->input ? j->input : "/dev/null", "r");
+    if (!j->in)
+    {
+        fprintf(j->fout, "%s: %s\n", j->input, strerror(errno));
+        j->state = JFAIL;
+        return -1;
+    }
+
+    if (warm && j->code == warm->prog)
+    {
+        j->vm = clonevm(warm);
+        j->vm->in = j->in;
+        j->vm->out = j->fout;
+        j->vm->err = j->fout;
+    }
+    else
+    {
+        j->vm = newvm();
+        vmreset(j->vm, j->code, j->in, j->fout, j->fout);
+    }
+    return 0;
+}
+
+/* run j for a slice, returns 1 when it is done */
+static int step(Job *j)
+{
+    jmp_buf jb;
+    long long fuel;
+    double t;
+    int halted;
+
+    if (!j->vm && start(j) < 0)
+        return 1;
+
+    fuel = SLICE;
+    if (quota > 0)
+        fuel = min(fuel, quota - j->vm->used);
+
+    t = clockms(1);
+    j->vm->jb = &jb;
+    if (setjmp(jb))
+    {
+        j->cpu += clockms(1) - t;
+        j->state = JFAIL;
+        return 1;
+    }
+    halted = runvm(j->vm, fuel);
+    j->vm->jb = NULL;
+    j->cpu += clockms(1) - t;
+    j->used = j->vm->used;
+
+    if (halted)
+        j->state = JOK;
+    else if (quota > 0 && j->used >= quota)
+    {
+        fprintf(j->fout, "vm: out of fuel after %lld instructions\n", j->used);
+        j->state = JQUOTA;
+    }
+    else if (timeout > 0 && clockms(0) - j->start >= timeout)
+    {
+        fprintf(j->fout, "vm: timed out after %d ms\n", timeout);
+        j->state = JTIME;
+    }
+    return j->state != JRUN;
+}
+
+static void finish(Job *j)
+{
+    j->wall = clockms(0) - j->start;
+    if (j->vm)
+        freevm(j->vm);
+    if (j->in)
+        fclose(j->in);
+    fclose(j->fout);
+    j->vm = NULL;
+
+    pthread_mutex_lock(&lock);
+    if (++ndone == njobs)
+        pthread_cond_broadcast(&idle);
+    pthread_mutex_unlock(&lock);
+}
+
+/* sleep until a job got put on a queue since the count was
+   seen, returns 1 when there is nothing left to run */
+static int idlewait(int seen)
+{
+    int r;
+
+    pthread_mutex_lock(&lock);
+    nidle++;
+    while (nput == seen && ndone < njobs)
+        pthread_cond_wait(&idle, &lock);
+    nidle--;
+    r = ndone == njobs;
+    pthread_mutex_unlock(&lock);
+    return r;
+}
+
+static int putcount(void)
+{
+    int n;
+
+    pthread_mutex_lock(&lock);
+    n = nput;
+    pthread_mutex_unlock(&lock);
+    return n;
+}
+
+static void *worker(void *arg)
+{
+    Queue *self;
+    Job *j;
+    int id, i, seen;
+
+    id = (int)(intptr_t)arg;
+    self = &queues[id];
+    for (;;)
+    {
+        /* a put after the count gets seen wakes the wait up, one
+           before it is on a queue the thieving gets to */
+        seen = putcount();
+        j = take(self);
+        for (i = 1; !j && i < nqueues; i++)
+            j = steal(&queues[(id + i) % nqueues]);
+
+        if (!j)
+        {
+            if (idlewait(seen))
+                break;
+            continue;
+        }
+
+        if (step(j))
+            finish(j);
+        else
+            put(self, j);
+    }
+    return NULL;
+}
+
+/* run the jobs in f on nthreads threads, or one for every
+   cpu, returns how many of them didn't end ok */
+int batch(char *f, int nthreads, int vmfile)
+{
+    pthread_t *tid;
+    Job *j;
+    int i, n[nelem(jobstate)];
+
+    /* the trace jit makes its code in state there is one of, so
+       the threads can't share it, the code gets loaded for the
+       threaded loop it would fall back to */
+    if (engine == ETRACE)
+        engine = ETHREAD;
+
+    readjobs(f);
+    loadjobs(vmfile);
+    if (njobs == 0)
+        return 0;
+    if (resume)
+        loadwarm();
+
+    if (nthreads <= 0)
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    nthreads = max(1, min(nthreads, njobs));
+
+    /* deal the jobs out, the threads even it out from there */
+    nqueues = nthreads;
+    queues = emalloc(sizeof(queues[0]) * nqueues);
+    for (i = 0; i < nqueues; i++)
+    {
+        queues[i].q = emalloc(sizeof(queues[i].q[0]) * njobs);
+        queues[i].head = 0;
+        queues[i].len = 0;
+        pthread_mutex_init(&queues[i].lock, NULL);
+    }
+    for (i = 0; i < njobs; i++)
+        put(&queues[i % nqueues], &jobs[i]);
+
+    tid = emalloc(sizeof(tid[0]) * nthreads);
+    for (i = 0; i < nthreads; i++)
+    {
+        if (pthread_create(&tid[i], NULL, worker, (void*)(intptr_t)i) != 0)
+            die("batch: can't make a thread");
+    }
+    for (i = 0; i < nthreads; i++)
+        pthread_join(tid[i], NULL);
+    free(tid);
+
+    memset(n, 0, sizeof(n));
+    for (i = 0; i < njobs; i++)
+    {
+        j = &jobs[i];
+        printf("== %s%s%s: %s", j->prog, j->input ? " < " : "", j->input ? j->input : "",
+            jobstate[j->state]);
+        if (j->state != JFAIL)
+            printf(", %lld instructions", j->used);
+        printf(", %.3f ms cpu, %.3f ms\n", j->cpu, j->wall);
+        fwrite(j->out, 1, j->outlen, stdout);
+        n[j->state]++;
+        free(j->out);
+    }
+    printf("== %d jobs: %d ok, %d failed, %d out of fuel, %d timed out\n",
+        njobs, n[JOK], n[JFAIL], n[JQUOTA], n[JTIME]);
+
+    for (i = 0; i < nqueues; i++)
+    {
+        pthread_mutex_destroy(&queues[i].lock);
+        free(queues[i].q);
+    }
+    free(queues);
+    if (warm)
+        freevm(warm);
+    return njobs - n[JOK];
+}
@@ -0,0 +1,463 @@
+#include "dat.h"
+#include "fns.h"
+
+/* the closure engine, every instruction of the fused code gets
+   turned into a Cl, a pointer to a small C function with its
+   operands bound to it, and running the code is calling them
+   one after the other, every one returns the next to call:
+
+   the ones in a basic block follow each other in memory so
+   going on is c + 1, a jump or call points right at the Cl
+   it goes to, and only a return looks its Cl up by the pc
+   on the stack
+
+   it is all standard C so it runs wherever cc does, on the
+   verified code only, and it keeps the machine the way the
+   stack vm does, so it stops and goes on in slices the same */
+
+typedef struct Run Run;
+
+struct Cl
+{
+    Cl  *(*fn)(Cl*, Run*);
+    Cl   *to;
+    Sup  *s;
+    int   l, m;
+    int   pc;
+};
+
+/* the registers of the machine while the closures run */
+struct Run
+{
+    int      *stk;
+    int       sp;
+    int       bp;
+    int       mark;
+    int       top;
+    long long fuel;
+    Cl       *code;
+    VM       *vm;
+};
+
+#define FN(x) static Cl *x(Cl *c, Run *r)
+
+/* charge the fuel for the instructions since the last time
+   and go to to, or stop there when it ran out */
+static Cl *go(Cl *c, Run *r, Cl *to)
+{
+    r->fuel -= c->pc - r->mark + 1;
+    r->mark = to->pc;
+    if (r->fuel <= 0)
+    {
+        r->vm->pc = to->pc;
+        return NULL;
+    }
+    return to;
+}
+
+static Cl *halt(Cl *c, Run *r)
+{
+    r->fuel -= c->pc - r->mark + 1;
+    r->vm->pc = c->pc + 1;
+    r->vm->halt = 1;
+    return NULL;
+}
+
+static int ubase(int *stk, int l, int b)
+{
+    while (l > 0)
+    {
+        b = stk[b + 1];
+        l--;
+    }
+    return b;
+}
+
+/* make room for the frame that starts at bp */
+static void room(Cl *c, Run *r, int bp)
+{
+    if (bp + r->top > r->vm->stklen)
+    {
+        r->vm->oldpc = c->pc;
+        stkgrow(r->vm, bp + r->top);
+        r->stk = r->vm->stk;
+    }
+}
+
+FN(cbad)
+{
+    r->vm->oldpc = c->pc;
+    badins(r->vm);
+    return halt(c, r);
+}
+
+FN(clit)
+{
+    r->stk[++r->sp] = c->m;
+    return c + 1;
+}
+
+FN(cneg)
+{
+    r->stk[r->sp] = -r->stk[r->sp];
+    return c + 1;
+}
+
+FN(codd)
+{
+    r->stk[r->sp] %= 2;
+    return c + 1;
+}
+
+/* the binary ops, on the two on top or the top and a constant */
+#define BIN(x, op) \
+    FN(x) \
+    { \
+        int *s; \
+        s = &r->stk[r->sp--]; \
+        s[-1] = s[-1] op s[0]; \
+        return c + 1; \
+    }
+#define BINK(x, op) \
+    FN(x) \
+    { \
+        r->stk[r->sp] = r->stk[r->sp] op c->m; \
+        return c + 1; \
+    }
+
+BIN(cadd, +) BIN(csub, -) BIN(cmul, *)
+BIN(ceql, ==) BIN(cneq, !=) BIN(clss, <) BIN(cleq, <=) BIN(cgtr, >) BIN(cgeq, >=)
+BINK(caddk, +) BINK(csubk, -) BINK(cmulk, *)
+BINK(ceqlk, ==) BINK(cneqk, !=) BINK(clssk, <) BINK(cleqk, <=) BINK(cgtrk, >) BINK(cgeqk, >=)
+
+FN(cdiv)
+{
+    int *s;
+
+    s = &r->stk[r->sp--];
+    if (s[0] == 0)
+        vmdie(r->vm, "vm: divide by 0");
+    s[-1] /= s[0];
+    return c + 1;
+}
+
+FN(cmod)
+{
+    int *s;
+
+    s = &r->stk[r->sp--];
+    if (s[0] == 0)
+        vmdie(r->vm, "vm: mod by 0");
+    s[-1] %= s[0];
+    return c + 1;
+}
+
+FN(cdivk)
+{
+    if (c->m == 0)
+        vmdie(r->vm, "vm: divide by 0");
+    r->stk[r->sp] /= c->m;
+    return c + 1;
+}
+
+FN(cmodk)
+{
+    if (c->m == 0)
+        vmdie(r->vm, "vm: mod by 0");
+    r->stk[r->sp] %= c->m;
+    return c + 1;
+}
+
+/* the variables, of the frame the code is in, of one found
+   by following static links or of one from the display */
+FN(clodl)
+{
+    r->stk[r->sp + 1] = r->stk[r->bp + c->m];
+    r->sp++;
+    return c + 1;
+}
+
+FN(cstol)
+{
+    r->stk[r->bp + c->m] = r->stk[r->sp--];
+    return c + 1;
+}
+
+FN(clod)
+{
+    r->stk[r->sp + 1] = r->stk[ubase(r->stk, c->l, r->bp) + c->m];
+    r->sp++;
+    return c + 1;
+}
+
+FN(csto)
+{
+    r->stk[ubase(r->stk, c->l, r->bp) + c->m] = r->stk[r->sp--];
+    return c + 1;
+}
+
+FN(clodd)
+{
+    r->stk[r->sp + 1] = r->stk[r->vm->display[c->l] + c->m];
+    r->sp++;
+    return c + 1;
+}
+
+FN(cstod)
+{
+    r->stk[r->vm->display[c->l] + c->m] = r->stk[r->sp--];
+    return c + 1;
+}
+
+/* a call, with the static link from the frame l links up */
+static int call(Cl *c, Run *r, int link)
+{
+    int *stk, sp, bp;
+
+    stk = r->stk;
+    sp = r->sp;
+    stk[sp + 1] = 0;
+    stk[sp + 2] = link;
+    stk[sp + 3] = r->bp;
+    stk[sp + 4] = c->pc + 1;
+    bp = sp + 1;
+    r->bp = bp;
+    room(c, r, bp);
+    return bp;
+}
+
+FN(ccal)
+{
+    if (call(c, r, ubase(r->stk, c->l, r->bp)) <= 0)
+        return halt(c, r);
+    return go(c, r, c->to);
+}
+
+FN(ccald)
+{
+    VM *vm;
+    int bp;
+
+    vm = r->vm;
+    bp = call(c, r, vm->display[c->l - 1]);
+    vm->dsave[vm->depth++ & vm->dmask] = vm->display[c->l];
+    vm->display[c->l] = bp;
+    if (bp <= 0)
+        return halt(c, r);
+    return go(c, r, c->to);
+}
+
+FN(ctcl)
+{
+    r->stk[r->bp] = 0;
+    r->sp = r->bp - 1;
+    return go(c, r, c->to);
+}
+
+FN(cret)
+{
+    int *stk, sp;
+
+    stk = r->stk;
+    sp = r->bp - 1;
+    r->sp = sp;
+    r->bp = stk[sp + 3];
+    if (sp <= 0)
+        return halt(c, r);
+    return go(c, r, &r->code[stk[sp + 4]]);
+}
+
+FN(cretd)
+{
+    VM *vm;
+    int *stk, sp;
+
+    vm = r->vm;
+    stk = r->stk;
+    sp = r->bp - 1;
+    r->sp = sp;
+    r->bp = stk[sp + 3];
+    if (c->l > 0 && vm->depth > 0)
+        vm->display[c->l] = vm->dsave[--vm->depth & vm->dmask];
+    if (sp <= 0)
+        return halt(c, r);
+    return go(c, r, &r->code[stk[sp + 4]]);
+}
+
+FN(cinc)
+{
+    r->sp += c->m;
+    return c + 1;
+}
+
+FN(cjmp)
+{
+    return go(c, r, c->to);
+}
+
+FN(cjpc)
+{
+    return go(c, r, (r->stk[r->sp--] == 0) ? c->to : c + 1);
+}
+
+FN(csio1)
+{
+    fprintf(r->vm->out, "Value on top of the stack: %d\n", r->stk[r->sp--]);
+    r->vm->nwrite++;
+    return c + 1;
+}
+
+FN(csio2)
+{
+    int v;
+
+    v = readin(r->vm);
+    r->stk[++r->sp] = v;
+    return c + 1;
+}
+
+FN(clds)
+{
+    r->stk[r->sp + c->m] = r->stk[r->sp];
+    r->sp--;
+    return c + 1;
+}
+
+/* the superinstructions, the ones on variables go through the display */
+#define VAR(l, m) r->stk[r->vm->display[l] + (m)]
+#define SUPER(x, e) \
+    FN(x) \
+    { \
+        Sup *s; \
+        s = c->s; \
+        VAR(s->l3, s->m3) = e; \
+        return c + 1; \
+    }
+
+SUPER(caddvv, VAR(s->l1, s->m1) + VAR(s->l2, s->m2))
+SUPER(csubvv, VAR(s->l1, s->m1) - VAR(s->l2, s->m2))
+SUPER(cmulvv, VAR(s->l1, s->m1) * VAR(s->l2, s->m2))
+SUPER(caddvk, VAR(s->l1, s->m1) + s->m2)
+SUPER(csubvk, VAR(s->l1, s->m1) - s->m2)
+
+FN(clods)
+{
+    r->stk[r->sp + 1 + c->s->m2] = VAR(c->s->l1, c->s->m1);
+    return c + 1;
+}
+
+FN(clits)
+{
+    r->stk[r->sp + 1 + c->m] = c->l;
+    return c + 1;
+}
+
+/* the fused conditional jumps, they go to to when it is false */
+#define JUMP(x, op) \
+    FN(x) \
+    { \
+        int *s; \
+        s = &r->stk[r->sp]; \
+        r->sp -= 2; \
+        return go(c, r, !(s[-1] op s[0]) ? c->to : c + 1); \
+    }
+#define JUMPK(x, op) \
+    FN(x) \
+    { \
+        return go(c, r, !(r->stk[r->sp--] op c->l) ? c->to : c + 1); \
+    }
+
+JUMP(cjeql, ==) JUMP(cjneq, !=) JUMP(cjlss, <) JUMP(cjleq, <=) JUMP(cjgtr, >) JUMP(cjgeq, >=)
+JUMPK(cjeqlk, ==) JUMPK(cjneqk, !=) JUMPK(cjlssk, <) JUMPK(cjleqk, <=) JUMPK(cjgtrk, >) JUMPK(cjgeqk, >=)
+
+FN(cjodd)
+{
+    return go(c, r, (r->stk[r->sp--] % 2 == 0) ? c->to : c + 1);
+}
+
+static Cl *(*const fns[NXOP])(Cl*, Run*) =
+{
+    [XBAD] = cbad, [XLIT] = clit, [XRET] = cret, [XNEG] = cneg,
+    [XADD] = cadd, [XSUB] = csub, [XMUL] = cmul, [XDIV] = cdiv,
+    [XODD] = codd, [XMOD] = cmod, [XEQL] = ceql, [XNEQ] = cneq,
+    [XLSS] = clss, [XLEQ] = cleq, [XGTR] = cgtr, [XGEQ] = cgeq,
+    [XLOD] = clod, [XSTO] = csto, [XCAL] = ccal, [XINC] = cinc,
+    [XJMP] = cjmp, [XJPC] = cjpc, [XSIO1] = csio1, [XSIO2] = csio2,
+    [XLDS] = clds, [XLODD] = clodd, [XSTOD] = cstod, [XCALD] = ccald,
+    [XRETD] = cretd,
+    [XADDVV] = caddvv, [XSUBVV] = csubvv, [XMULVV] = cmulvv,
+    [XADDVK] = caddvk, [XSUBVK] = csubvk,
+    [XADDK] = caddk, [XSUBK] = csubk, [XMULK] = cmulk, [XDIVK] = cdivk,
+    [XMODK] = cmodk, [XEQLK] = ceqlk, [XNEQK] = cneqk, [XLSSK] = clssk,
+    [XLEQK] = cleqk, [XGTRK] = cgtrk, [XGEQK] = cgeqk,
+    [XJEQL] = cjeql, [XJNEQ] = cjneq, [XJLSS] = cjlss, [XJLEQ] = cjleq,
+    [XJGTR] = cjgtr, [XJGEQ] = cjgeq, [XJODD] = cjodd,
+    [XJEQLK] = cjeqlk, [XJNEQK] = cjneqk, [XJLSSK] = cjlssk,
+    [XJLEQK] = cjleqk, [XJGTRK] = cjgtrk, [XJGEQK] = cjgeqk,
+    [XLODS] = clods, [XLITS] = clits,
+    [XLOD0] = clodl, [XSTO0] = cstol, [XLIT0] = clit, [XLIT1] = clit,
+    [XTCL] = ctcl
+};
+
+/* bind the fused code of p to closures, one more than
+   there are instructions for the XBAD at the end */
+Cl *clcompile(Prog *p)
+{
+    Cl *code, *c;
+    Xins *ir;
+    int pc, op;
+
+    code = emalloc(sizeof(code[0]) * (p->xlen + 1));
+    for (pc = 0; pc <= p->xlen; pc++)
+    {
+        c = &code[pc];
+        ir = &p->xins[pc];
+        op = ir->op;
+
+        c->fn = fns[op] ? fns[op] : cbad;
+        c->l = ir->l;
+        c->m = ir->m;
+        c->pc = pc;
+
+        switch (op)
+        {
+            case XADDVV: case XSUBVV: case XMULVV:
+            case XADDVK: case XSUBVK: case XLODS:
+                c->s = &p->sup[ir->m];
+                break;
+        }
+
+        /* the verifier made sure these land in the code */
+        if (op == XCAL || op == XCALD || op == XTCL || op == XJMP || op == XJPC || (op >= XJEQL && op <= XJGEQK))
+            c->to = &code[min(ir->m, p->xlen)];
+    }
+    return code;
+}
+
+/* run vm on the closures of its code, from vm->pc with the
+   fuel in vm->fuel, like the dispatch loops of the stack vm */
+void runclosure(VM *vm)
+{
+    Run r;
+    Cl *c;
+
+    r.stk = vm->stk;
+    r.sp = vm->sp;
+    r.bp = vm->bp;
+    r.mark = vm->pc;
+    r.top = vm->prog->top;
+    r.fuel = vm->fuel;
+    r.code = vm->prog->cl;
+    r.vm = vm;
+
+    c = &r.code[vm->pc];
+    while (c)
+    {
+        COUNT;
+        c = c->fn(c, &r);
+    }
+
+    vm->sp = r.sp;
+    vm->bp = r.bp;
+    vm->fuel = r.fuel;
+}
@@ -0,0 +1,330 @@
+#include "dat.h"
+#include "fns.h"
+
+/* the split stack vm, the static link, dynamic link and return
+   pc of every frame go on a control stack of their own instead
+   of between the locals, so the data stack only has the return
+   value, the locals and the temporaries of every frame, and a
+   static link walk only goes through the small control records
+   and never through the data
+
+   the frame offsets in the code get moved down over the three
+   words that aren't there anymore when the code is translated,
+   that needs the code to be verified so nothing reads or writes
+   those words, anything else runs on the stack vm
+
+   without the gap the arguments would be stored right where the
+   next argument gets worked out, so LDS leaves them on the stack
+   instead and CAL moves them all up a word to make room for the
+   return value, that only works for the arguments the way the
+   parser passes them, one expression and LDS after the other
+   straight into the CAL */
+
+typedef struct Cins Cins;
+typedef struct Ctl Ctl;
+
+/* a instruction with its op decoded and its offsets moved,
+   n is how many arguments a CAL takes off the stack */
+struct Cins
+{
+    int op, l, m, n;
+};
+
+/* a control record, bp of the frame, the record of the frame
+   its static link goes to and where to go back to */
+struct Ctl
+{
+    int bp;
+    int sl;
+    int ret;
+};
+
+/* the words of the frame header that move to the control stack */
+#define GONE (FRAME - 1)
+
+/* move a frame offset down over the header, -1 if it is in it */
+static int moved(int m)
+{
+    if (m == RA)
+        return RA;
+    if (m < FRAME)
+        return -1;
+    return m - GONE;
+}
+
+static int isjump(int op)
+{
+    return op == XJMP || op == XJPC || op == XCAL || op == XTCL;
+}
+
+static Cins *translate(Prog *p)
+{
+    Cins *code, *c;
+    Ins *ins;
+    char *label;
+    int pc, op, narg, d;
+
+    code = emalloc(sizeof(code[0]) * (p->inslen + 1));
+    label = emalloc(p->inslen + 1);
+    for (pc = 0; pc < p->inslen; pc++)
+    {
+        ins = &p->wide[pc];
+        if (isjump(decode(ins)) && (ins->m & (MAX_CODE_LENGTH-1)) < p->inslen)
+            label[ins->m & (MAX_CODE_LENGTH-1)] = 1;
+    }
+
+    /* narg is how many arguments are on the stack for the next
+       CAL, d how many values the expression after the last one
+       put on top of them */
+    narg = 0;
+    d = 0;
+    for (pc = 0; pc < p->inslen; pc++)
+    {
+        ins = &p->wide[pc];
+        c = &code[pc];
+        op = c->op = decode(ins);
+        c->l = ins->l;
+        c->m = ins->m;
+        if (narg > 0 && label[pc])
+            goto fail;
+
+        switch (op)
+        {
+            case XLOD:
+            case XSTO:
+            case XINC:
+                c->m = moved(ins->m);
+                if (c->m < 0 || (op == XINC && c->m == RA))
+                    goto fail;
+                break;
+
+            case XLDS:
+                if ((narg > 0 && d != 1) || ins->m != FRAME + narg)
+                    goto fail;
+                narg++;
+                d = 0;
+                continue;
+
+            case XCAL:
+                if (d != 0)
+                    goto fail;
+                c->n = narg;
+                narg = 0;
+                continue;
+        }
+
+        if (narg == 0)
+            continue;
+
+        /* what can be in a argument expression */
+        switch (op)
+        {
+            case XLIT:
+            case XLOD:
+                d++;
+                break;
+
+            case XNEG:
+            case XODD:
+                if (d < 1)
+                    goto fail;
+                break;
+
+            case XADD: case XSUB: case XMUL: case XDIV: case XMOD:
+            case XEQL: case XNEQ: case XLSS: case XLEQ: case XGTR: case XGEQ:
+                if (d < 2)
+                    goto fail;
+                d--;
+                break;
+
+            default:
+                goto fail;
+        }
+    }
+    if (narg > 0)
+        goto fail;
+    code[pc].op = XBAD;
+    free(label);
+    return code;
+
+fail:
+    free(label);
+    free(code);
+    return NULL;
+}
+
+/* the record of the frame l static links out of record c */
+static int anc(Ctl *ctl, int c, int l)
+{
+    while (l-- > 0)
+        c = ctl[c].sl;
+    return c;
+}
+
+/* run the code of p on vm with a control stack, -1 if it
+   can't because the code didn't verify */
+int ctlexec(VM *vm, Prog *p)
+{
+    Cins *code, *ir;
+    Ctl *ctl;
+    int *stk, pc, sp, bp, c, nctl, top, limit, v;
+#ifdef VMSTATS
+    long long ncall;
+    int deepest, highest;
+
+    ncall = 0;
+    deepest = 0;
+    highest = 0;
+#endif
+
+    if (!p->verified)
+        return -1;
+    code = translate(p);
+    if (!code)
+        return -1;
+
+    nctl = 1024;
+    ctl = emalloc(sizeof(ctl[0]) * nctl);
+    stk = vm->stk;
+    limit = vm->stklen;
+    top = max(p->top - GONE, 1);
+
+    /* the main program, its record is its own static link */
+    c = 0;
+    ctl[0].bp = 1;
+    ctl[0].sl = 0;
+    ctl[0].ret = 0;
+    bp = 1;
+    sp = 0;
+    pc = 0;
+
+#define S(x) stk[bp + (x)]
+
+    for (;;)
+    {
+        ir = &code[pc++];
+        COUNT;
+        switch (ir->op)
+        {
+            case XLIT: stk[++sp] = ir->m; break;
+            case XNEG: stk[sp] = -stk[sp]; break;
+            case XODD: stk[sp] %= 2; break;
+
+            case XADD: sp--; stk[sp] += stk[sp + 1]; break;
+            case XSUB: sp--; stk[sp] -= stk[sp + 1]; break;
+            case XMUL: sp--; stk[sp] *= stk[sp + 1]; break;
+            case XDIV:
+                sp--;
+                if (stk[sp + 1] == 0)
+                    die("vm: divide by 0");
+                stk[sp] /= stk[sp + 1];
+                break;
+            case XMOD:
+                sp--;
+                if (stk[sp + 1] == 0)
+                    die("vm: mod by 0");
+                stk[sp] %= stk[sp + 1];
+                break;
+            case XEQL: sp--; stk[sp] = (stk[sp] == stk[sp + 1]); break;
+            case XNEQ: sp--; stk[sp] = (stk[sp] != stk[sp + 1]); break;
+            case XLSS: sp--; stk[sp] = (stk[sp] <  stk[sp + 1]); break;
+            case XLEQ: sp--; stk[sp] = (stk[sp] <= stk[sp + 1]); break;
+            case XGTR: sp--; stk[sp] = (stk[sp] >  stk[sp + 1]); break;
+            case XGEQ: sp--; stk[sp] = (stk[sp] >= stk[sp + 1]); break;
+
+            case XLOD:
+                v = (ir->l == 0) ? S(ir->m) : stk[ctl[anc(ctl, c, ir->l)].bp + ir->m];
+                stk[++sp] = v;
+                break;
+
+            case XSTO:
+                if (ir->l == 0)
+                    S(ir->m) = stk[sp--];
+                else
+                    stk[ctl[anc(ctl, c, ir->l)].bp + ir->m] = stk[sp--];
+                break;
+
+            case XINC:
+                sp += ir->m;
+#ifdef VMSTATS
+                highest = max(highest, sp);
+#endif
+                break;
+
+            /* the argument stays where it is */
+            case XLDS:
+                break;
+
+            case XJMP:
+                pc = ir->m;
+                break;
+
+            case XJPC:
+                if (stk[sp--] == 0)
+                    pc = ir->m;
+                break;
+
+            case XCAL:
+                if (c + 1 >= nctl)
+                {
+                    nctl *= 2;
+                    ctl = realloc(ctl, sizeof(ctl[0]) * nctl);
+                    if (!ctl)
+                        die("oom trying to grow the control stack");
+                }
+                if (sp - ir->n + 1 + top > limit)
+                    die("vm: stack overflow at pc %d", (int)(ir - code));
+                for (v = sp; v > sp - ir->n; v--)
+                    stk[v + 1] = stk[v];
+                sp -= ir->n;
+                ctl[c + 1].sl = anc(ctl, c, ir->l);
+                ctl[c + 1].ret = pc;
+                ctl[++c].bp = bp = sp + 1;
+                S(RA) = 0;
+                pc = ir->m;
+#ifdef VMSTATS
+                ncall++;
+                deepest = max(deepest, c);
+#endif
+                break;
+
+            case XTCL:
+                S(RA) = 0;
+                sp = bp - 1;
+                pc = ir->m;
+                break;
+
+            case XRET:
+                if (c == 0)
+                    goto out;
+                sp = bp - 1;
+                pc = ctl[c--].ret;
+                bp = ctl[c].bp;
+                break;
+
+            case XSIO1:
+                printf("Value on top of the stack: %d\n", stk[sp--]);
+                break;
+
+            case XSIO2:
+                stk[++sp] = readnum();
+                break;
+
+            default:
+                fprintf(stderr, "vm: unknown instruction: OP: %d L: %d M: %d\n",
+                    p->wide[pc - 1].op, p->wide[pc - 1].l, p->wide[pc - 1].m);
+                goto out;
+        }
+    }
+
+#undef S
+
+out:
+#ifdef VMSTATS
+    fprintf(stderr, "vm: %lld calls, %d frames deep, %d words of data stack, %d of control stack\n",
+        ncall, deepest, highest, (deepest + 1) * (int)(sizeof(Ctl) / sizeof(int)));
+#endif
+    free(ctl);
+    free(code);
+    return 0;
+}
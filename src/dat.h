@@ -6,6 +6,8 @@
 #include <stdarg.h>
 #include <ctype.h>
 #include <errno.h>
+#include <stdint.h>
+#include <setjmp.h>
 
 /* max sizes for things, a more advance compiler
    would be able to generate arbitarily
@@ -16,6 +18,16 @@
 #define MAX_CODE_LENGTH  (1024*1024)
 #define MAX_LEXI_LEVEL   5
 
+/* the vm stack starts out this big and doubles when it
+   needs to, up to the limit, MAX_STACK_HEIGHT by default */
+#define STACK_CHUNK      (4*1024)
+#define MAX_STACK_LIMIT  (64*1024*1024)
+
+/* the instructions a machine runs at a time when it is being
+   run in slices, and the fuel that never runs out */
+#define SLICE            (64*1024)
+#define NOFUEL           ((long long)1 << 62)
+
 #define MAX_IDENT 11
 #define MAX_DIGIT 5
 
@@ -40,16 +52,161 @@ enum
 };
 
 typedef struct Ins Ins;
+typedef uint32_t Code;
+typedef struct Xins Xins;
+typedef struct Sup Sup;
+typedef struct Prog Prog;
+typedef struct VM VM;
+typedef struct Jit Jit;
+typedef struct Trace Trace;
+typedef struct Exit Exit;
+typedef struct Cl Cl;
 typedef struct Token Token;
 typedef struct Sym Sym;
 typedef struct Symtab Symtab;
+typedef struct Dsym Dsym;
+typedef struct Loc Loc;
 
-/* instruction format */
+/* instruction format, what the passes over the code work with,
+   the code itself is kept packed into a Code by pack() */
 struct Ins
 {
     int op, l, m;
 };
 
+/* where in the source the parser was when it emitted a
+   instruction, the line and column of the token it was at */
+struct Loc
+{
+    int line;
+    int col;
+};
+
+/* a instruction as the dispatch loops run it, op is the
+   decoded op, a L that doesn't fit in 24 bits makes it XBAD */
+struct Xins
+{
+    unsigned int op : 8;
+    signed int   l  : 24;
+    int          m;
+};
+
+/* the extra operands of a superinstruction, the
+   loads it fuses and where the result goes */
+struct Sup
+{
+    int l1, m1;
+    int l2, m2;
+    int l3, m3;
+};
+
+/* the code as the vm runs it, built once when it gets loaded
+   and only read after that, so any number of VMs can share it,
+   ins is only good until the next load, lev has the lexical
+   level of every instruction when dmode is set, hash is
+   what a snapshot of a machine running it gets checked by
+   and cl is the code bound to closures for the closure engine */
+struct Prog
+{
+    Code  *ins;
+    Ins   *wide;
+    int    inslen;
+
+    Xins  *xins;
+    int   *xsrc;
+    Sup   *sup;
+    void **hand;
+    int    xlen;
+
+    int    dmode;
+    int   *lev;
+    int    verified;
+    int    top;
+    int    fast;
+
+    Cl    *cl;
+    uint32_t hash;
+
+    Loc   *loc;
+    char  *src;
+};
+
+/* the state of a running machine, the stack is its own and
+   the code is a Prog, input comes from in and output goes to
+   out and err, runtime errors longjmp to jb when it is set
+   instead of exiting */
+struct VM
+{
+    Prog    *prog;
+
+    int     *stk;
+    int      stklen;
+    size_t   stkmap;
+
+    int      sp;
+    int      bp;
+    int      pc;
+    int      oldpc;
+    int      halt;
+    int      trap;
+    long long fuel;
+    long long used;
+    long long nread;
+    long long nwrite;
+
+    int     *ar;
+    int      lastar;
+
+    int      display[MAX_LEXI_LEVEL+1];
+    int     *dsave;
+    int      dmask;
+    int      depth;
+
+    FILE    *in;
+    FILE    *out;
+    FILE    *err;
+    jmp_buf *jb;
+
+    Jit     *jit;
+};
+
+/* what the trace jit keeps for a machine, how many times every
+   loop went around, by the fused pc of its top, the loops it
+   compiled and the pcs the branches went to while it records
+   the one in rec */
+struct Jit
+{
+    int     *count;
+    Trace  **trace;
+    int      ntrace;
+
+    int      rec;
+    int     *path;
+    int      npath;
+};
+
+/* a loop compiled to machine code, fn runs it from the top
+   until it takes a exit, len instructions every time around,
+   it is somewhere in the size bytes mapped at mem */
+struct Trace
+{
+    void    *fn;
+    void    *mem;
+    size_t   size;
+    int      len;
+    Exit    *exit;
+};
+
+/* where the machine goes on after a exit from a trace, sp
+   is from the sp at the top and ran is how many instructions
+   of the last time around it did */
+struct Exit
+{
+    int pc;
+    int sp;
+    int ran;
+};
+
 /* a token */
 struct Token
 {
@@ -78,6 +235,18 @@ struct Symtab
     int len;
 };
 
+/* a name the parser declared, kept for the debugger after the
+   symbol tables are gone, proc is the procedure it was declared
+   in, -1 for the main program itself, the body of a procedure
+   is the code from start up to end */
+struct Dsym
+{
+    Sym sym;
+    int proc;
+    int start;
+    int end;
+};
+
 /* all the keywords for the grammars, there are some special 
    ones like error and eof, which is used to stop or error out 
 */
@@ -97,10 +266,11 @@ enum
     symconst, symint, symproc
 };
 
-/* all the instructions for the VM */
+/* all the instructions for the VM, TCL is a call in tail
+   position to a procedure at the same level, it reuses the frame */
 enum
 {
-    OLIT = 1, OOPR, OLOD, OSTO, OCAL, OINC, OJMP, OJPC, OSIO1, OSIO2, OLDS
+    OLIT = 1, OOPR, OLOD, OSTO, OCAL, OINC, OJMP, OJPC, OSIO1, OSIO2, OLDS, OTCL
 };
 
 /* the OPR M field */
@@ -110,9 +280,65 @@ enum
     OMOD, OEQL, ONEQ, OLSS, OLEQ, OGTR, OGEQ
 };
 
+/* the instructions as the dispatch loops see them, every
+   OPR gets its own entry so there is only one dispatch per
+   instruction, anything that doesn't decode is XBAD, the D ones
+   use the display instead of following static links, after those
+   come the superinstructions fuse() makes out of common sequences
+   and the quickened ones, loads and stores of the frame the code
+   is in and the constants 0 and 1, XTRAP is only ever patched in
+   by the debugger */
+#define XOPS \
+    X(XBAD) X(XLIT) X(XRET) X(XNEG) X(XADD) X(XSUB) X(XMUL) X(XDIV) \
+    X(XODD) X(XMOD) X(XEQL) X(XNEQ) X(XLSS) X(XLEQ) X(XGTR) X(XGEQ) \
+    X(XLOD) X(XSTO) X(XCAL) X(XINC) X(XJMP) X(XJPC) X(XSIO1) X(XSIO2) \
+    X(XLDS) X(XLODD) X(XSTOD) X(XCALD) X(XRETD) \
+    X(XADDVV) X(XSUBVV) X(XMULVV) X(XADDVK) X(XSUBVK) \
+    X(XADDK) X(XSUBK) X(XMULK) X(XDIVK) X(XMODK) \
+    X(XEQLK) X(XNEQK) X(XLSSK) X(XLEQK) X(XGTRK) X(XGEQK) \
+    X(XJEQL) X(XJNEQ) X(XJLSS) X(XJLEQ) X(XJGTR) X(XJGEQ) X(XJODD) \
+    X(XJEQLK) X(XJNEQK) X(XJLSSK) X(XJLEQK) X(XJGTRK) X(XJGEQK) \
+    X(XLODS) X(XLITS) \
+    X(XLOD0) X(XSTO0) X(XLIT0) X(XLIT1) X(XTCL) X(XTRAP)
+
+#define X(x) x,
+enum
+{
+    XOPS
+    NXOP
+};
+#undef X
+
+/* the ways the vm can run code */
+enum
+{
+    ETHREAD, ESWITCH, EREG, EJIT, ETOS, ETRACE, ECLOSURE, ESPLIT
+};
+
+/* build with -DVMSTATS to count the instructions the vm dispatches */
+#ifdef VMSTATS
+#define COUNT ndispatch++
+extern long long ndispatch;
+#else
+#define COUNT
+#endif
+
 /* shared globals for the program */
 extern int lexonly;
 extern int verbose;
+extern int engine;
+extern int showfuse;
+extern int stacklimit;
+extern long long quota;
+extern int timeout;
+extern long long ckpt;
+extern char *snapfile;
+extern char *tracefile;
+extern int debugging;
+extern char *profile;
+extern char *heatmap;
+extern int telemetry;
+extern int resume;
 
 extern long pos;
 extern long line;
@@ -124,5 +350,9 @@ extern char *ion;
 
 extern Token *curtok;
 
-extern Ins  code[MAX_CODE_LENGTH];
+extern Code code[MAX_CODE_LENGTH];
+extern Loc  loc[MAX_CODE_LENGTH];
 extern int  codepos;
+
+extern Dsym *dsym;
+extern int   ndsym;
@@ -0,0 +1,499 @@
+#define _DEFAULT_SOURCE
+#include "dat.h"
+#include "fns.h"
+
+#ifdef __unix__
+#include <unistd.h>
+#endif
+
+/* the debugger, -i, a breakpoint is a XTRAP patched over the
+   instruction in the code the loop runs, the trap stops the
+   machine before that instruction runs and the debugger puts
+   the instruction back to step over it, so the loops never check
+   for breakpoints themselves and the code runs just as fast with
+   them set until it gets to one
+
+   a step patches a trap over every instruction the one at pc
+   can go to next and takes them out again after it, a watch on
+   a variable patches every STO that stores to it and stops
+   after one of them changed it
+
+   the names come from the symbol map the parser leaves in dsym,
+   code loaded with -p doesn't have one and can only be debugged
+   by pc, the commands come from the input of the machine, one a
+   line, the same as the numbers the program reads */
+
+enum
+{
+    BREAK = 1 << 0,
+    WATCH = 1 << 1,
+    STEP  = 1 << 2
+};
+
+static Prog *prog;
+static Xins *orig;
+static char *mark;
+static int  *wvar;
+static FILE *out;
+
+/* the marks of the instruction at pc, none past the code */
+static int marks(int pc)
+{
+    if (pc < 0 || pc >= prog->xlen)
+        return 0;
+    return mark[pc];
+}
+
+/* put a trap over the instruction at pc if it has any marks,
+   the instruction itself back if it doesn't */
+static void arm(int pc)
+{
+    Xins trap;
+
+    if (mark[pc])
+    {
+        trap = orig[pc];
+        trap.op = XTRAP;
+        patchins(prog, pc, &trap);
+    }
+    else
+        patchins(prog, pc, &orig[pc]);
+}
+
+static int word(VM *vm, int i)
+{
+    if (i < 0 || i >= vm->stklen)
+        return 0;
+    return vm->stk[i];
+}
+
+static int base(VM *vm, int l, int b)
+{
+    while (l-- > 0)
+        b = word(vm, b + 1);
+    return b;
+}
+
+static char *procname(int q)
+{
+    return (q < 0) ? "?" : dsym[q].sym.name;
+}
+
+static int findproc(char *name)
+{
+    int i;
+
+    for (i = 0; i < ndsym; i++)
+    {
+        if (dsym[i].sym.type == symproc && strcmp(dsym[i].sym.name, name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+/* the variable or constant name as the code of procedure q
+   sees it, declared in q or the procedures around it */
+static int lookup(char *name, int q)
+{
+    int i;
+
+    for (; q >= 0; q = dsym[q].proc)
+    {
+        for (i = 0; i < ndsym; i++)
+        {
+            if (dsym[i].proc == q && dsym[i].sym.type != symproc && strcmp(dsym[i].sym.name, name) == 0)
+                return i;
+        }
+    }
+    return -1;
+}
+
+/* the frame of procedure s, out the static links from the frame
+   bp of procedure q, -1 if s isn't around q */
+static int frameof(VM *vm, int q, int bp, int s)
+{
+    while (q >= 0 && q != s)
+    {
+        bp = word(vm, bp + 1);
+        q = dsym[q].proc;
+    }
+    return (q < 0) ? -1 : bp;
+}
+
+/* a pc, or the first instruction of the body of a procedure */
+static int pcof(char *s)
+{
+    char *e;
+    long n;
+    int i;
+
+    n = strtol(s, &e, 10);
+    if (*s != '\0' && *e == '\0')
+        return (n >= 0 && n < prog->inslen) ? n : -1;
+
+    i = findproc(s);
+    return (i < 0) ? -1 : dsym[i].start;
+}
+
+/* can the STO at pc store to variable v */
+static int stores(int pc, int v)
+{
+    Ins *in;
+    int q, l;
+
+    in = &prog->wide[pc];
+    q = mapproc(pc);
+    for (l = in->l; q >= 0 && l > 0; l--)
+        q = dsym[q].proc;
+    return q >= 0 && q == dsym[v].proc && in->m == dsym[v].sym.addr;
+}
+
+static void printpc(int pc, int at)
+{
+    Ins *in;
+
+    in = &prog->wide[pc];
+    fprintf(out, "%s%c %d\t%s\t%d\t%d\n", (pc == at) ? "=>" : "  ",
+        (mark[pc] & BREAK) ? '*' : ' ', pc, opname(in->op) ? opname(in->op) : "?", in->l, in->m);
+}
+
+static void where(VM *vm)
+{
+    Ins *in;
+
+    if (vm->halt)
+    {
+        fprintf(out, "the program has ended\n");
+        return;
+    }
+    if (vm->pc < 0 || vm->pc >= prog->inslen)
+    {
+        fprintf(out, "pc %d is past the code\n", vm->pc);
+        return;
+    }
+
+    in = &prog->wide[vm->pc];
+    fprintf(out, "pc %d in %s: %s %d %d\n", vm->pc, procname(mapproc(vm->pc)),
+        opname(in->op) ? opname(in->op) : "?", in->l, in->m);
+}
+
+/* where the instruction at pc can go next */
+static int successors(VM *vm, int *next)
+{
+    Ins *in;
+
+    in = &prog->wide[vm->pc];
+    switch (decode(in))
+    {
+        case XJMP:
+        case XCAL:
+        case XTCL:
+            next[0] = in->m;
+            return 1;
+
+        case XJPC:
+            next[0] = vm->pc + 1;
+            next[1] = in->m;
+            return 2;
+
+        case XRET:
+            next[0] = word(vm, vm->bp + 3);
+            return 1;
+    }
+    next[0] = vm->pc + 1;
+    return 1;
+}
+
+/* run the instruction at pc and stop at the one after it,
+   1 when the program ended */
+static int step(VM *vm)
+{
+    int next[2], i, n, pc, halt;
+
+    pc = vm->pc;
+    n = successors(vm, next);
+    for (i = 0; i < n; i++)
+    {
+        if (next[i] < 0 || next[i] >= prog->xlen || next[i] == pc)
+        {
+            next[i] = -1;
+            continue;
+        }
+        mark[next[i]] |= STEP;
+        arm(next[i]);
+    }
+
+    patchins(prog, pc, &orig[pc]);
+    vm->trap = 0;
+    halt = runvm(vm, NOFUEL);
+
+    for (i = 0; i < n; i++)
+    {
+        if (next[i] < 0)
+            continue;
+        mark[next[i]] &= ~STEP;
+        arm(next[i]);
+    }
+    arm(pc);
+    return halt;
+}
+
+/* run up to the next breakpoint or change of a watched variable,
+   or only the instruction at pc when stepping, 1 when the program
+   ended */
+static int go(VM *vm, int stepping)
+{
+    Ins *in;
+    int w, a, old;
+
+    a = old = 0;
+    for (;;)
+    {
+        if (vm->pc < 0 || vm->pc >= prog->xlen)
+        {
+            runvm(vm, NOFUEL);
+            return 1;
+        }
+
+        w = (mark[vm->pc] & WATCH) ? wvar[vm->pc] : -1;
+        if (w >= 0)
+        {
+            in = &prog->wide[vm->pc];
+            a = base(vm, in->l, vm->bp) + in->m;
+            old = word(vm, a);
+        }
+
+        if (step(vm))
+            return 1;
+        if (w >= 0 && word(vm, a) != old)
+        {
+            fprintf(out, "%s changed from %d to %d\n", dsym[w].sym.name, old, word(vm, a));
+            return 0;
+        }
+        if (stepping || (marks(vm->pc) & BREAK))
+            return 0;
+        if (marks(vm->pc) & WATCH)
+            continue;
+
+        vm->trap = 0;
+        if (runvm(vm, NOFUEL))
+            return 1;
+        if (marks(vm->pc) & BREAK)
+            return 0;
+    }
+}
+
+static void setbreak(char *arg, int on)
+{
+    int pc;
+
+    pc = pcof(arg);
+    if (pc < 0)
+    {
+        fprintf(out, "no pc or procedure %s\n", arg);
+        return;
+    }
+
+    if (on)
+        mark[pc] |= BREAK;
+    else
+        mark[pc] &= ~BREAK;
+    arm(pc);
+    fprintf(out, "breakpoint at pc %d in %s %s\n", pc, procname(mapproc(pc)), on ? "set" : "deleted");
+}
+
+static void setwatch(VM *vm, char *arg)
+{
+    int v, pc, n;
+
+    v = lookup(arg, mapproc(vm->pc));
+    if (v < 0 || dsym[v].sym.type != symint)
+    {
+        fprintf(out, "no variable %s here\n", arg);
+        return;
+    }
+    n = 0;
+    for (pc = 0; pc < prog->xlen; pc++)
+    {
+        if (decode(&prog->wide[pc]) == XSTO && stores(pc, v))
+        {
+            mark[pc] |= WATCH;
+            wvar[pc] = v;
+            arm(pc);
+            n++;
+        }
+    }
+    fprintf(out, "watching %s of %s, %d stores to it\n", arg, procname(dsym[v].proc), n);
+}
+
+/* the registers, the links of the frame and the variables of
+   the procedure at pc */
+static void frame(VM *vm)
+{
+    Dsym *d;
+    int q, bp, i;
+
+    q = mapproc(vm->pc);
+    bp = vm->bp;
+    fprintf(out, "%s, bp %d, sp %d, static link %d, dynamic link %d, return pc %d\n",
+        procname(q), bp, vm->sp, word(vm, bp + 1), word(vm, bp + 2), word(vm, bp + 3));
+
+    for (i = 0; q >= 0 && i < ndsym; i++)
+    {
+        d = &dsym[i];
+        if (d->proc != q || d->sym.type == symproc)
+            continue;
+        if (d->sym.type == symconst)
+            fprintf(out, "\t%s = %d (const)\n", d->sym.name, d->sym.lval);
+        else
+            fprintf(out, "\t%s = %d\n", d->sym.name, word(vm, bp + d->sym.addr));
+    }
+}
+
+/* the frames out the dynamic links, from the return pc of
+   each the CAL that made it is the one before it */
+static void backtrace(VM *vm)
+{
+    int pc, bp, n;
+
+    pc = vm->pc;
+    bp = vm->bp;
+    for (n = 0;; n++)
+    {
+        fprintf(out, "#%d %s at pc %d, bp %d\n", n, procname(mapproc(pc)), pc, bp);
+        if (bp <= 1 || word(vm, bp + 2) >= bp)
+            break;
+        pc = word(vm, bp + 3) - 1;
+        bp = word(vm, bp + 2);
+    }
+}
+
+static void printvar(VM *vm, char *arg)
+{
+    Dsym *d;
+    int q, v, bp;
+
+    q = mapproc(vm->pc);
+    v = lookup(arg, q);
+    if (v < 0)
+    {
+        fprintf(out, "no variable %s here\n", arg);
+        return;
+    }
+
+    d = &dsym[v];
+    if (d->sym.type == symconst)
+    {
+        fprintf(out, "%s = %d (const)\n", arg, d->sym.lval);
+        return;
+    }
+    bp = frameof(vm, q, vm->bp, d->proc);
+    fprintf(out, "%s = %d\n", arg, word(vm, bp + d->sym.addr));
+}
+
+/* the body of the procedure pc is in, or the code around pc */
+static void list(VM *vm, char *arg)
+{
+    int pc, q, i, start, end;
+
+    pc = (*arg != '\0') ? pcof(arg) : vm->pc;
+    if (pc < 0 || pc >= prog->inslen)
+    {
+        fprintf(out, "no pc or procedure %s\n", arg);
+        return;
+    }
+
+    q = mapproc(pc);
+    if (q >= 0 && dsym[q].start <= pc && pc < dsym[q].end)
+    {
+        start = dsym[q].start;
+        end = dsym[q].end;
+    }
+    else
+    {
+        start = max(pc - 5, 0);
+        end = min(pc + 6, prog->inslen);
+    }
+    for (i = start; i < end; i++)
+        printpc(i, vm->pc);
+}
+
+static void help(void)
+{
+    fprintf(out, "b pc|proc\tstop before the instruction at pc or the body of proc\n");
+    fprintf(out, "d pc|proc\tdelete the breakpoint\n");
+    fprintf(out, "w var\t\tstop when a store changes var\n");
+    fprintf(out, "s\t\trun one instruction\n");
+    fprintf(out, "c\t\trun to the next breakpoint or watch\n");
+    fprintf(out, "f\t\tprint the frame of the procedure at pc\n");
+    fprintf(out, "bt\t\tprint the frames the calls to here made\n");
+    fprintf(out, "p var\t\tprint var\n");
+    fprintf(out, "l [pc|proc]\tlist the code of the procedure\n");
+    fprintf(out, "q\t\tquit\n");
+}
+
+/* run the program of vm under the debugger */
+void debug(VM *vm)
+{
+    char buf[256], cmd[16], arg[32];
+    int tty, n;
+
+    prog = vm->prog;
+    out = vm->out;
+    orig = emalloc(sizeof(orig[0]) * (prog->xlen + 1));
+    memcpy(orig, prog->xins, sizeof(orig[0]) * (prog->xlen + 1));
+    mark = emalloc(prog->xlen + 1);
+    wvar = emalloc(sizeof(wvar[0]) * (prog->xlen + 1));
+
+    tty = 0;
+#ifdef __unix__
+    tty = isatty(fileno(vm->in));
+#endif
+
+    where(vm);
+    for (;;)
+    {
+        if (tty)
+        {
+            fprintf(out, "(pl0) ");
+            fflush(out);
+        }
+        if (!fgets(buf, sizeof(buf), vm->in))
+            break;
+
+        n = sscanf(buf, "%15s %31s", cmd, arg);
+        if (n < 1)
+            continue;
+        if (n < 2)
+            arg[0] = '\0';
+
+        if (strcmp(cmd, "q") == 0)
+            break;
+        else if (strcmp(cmd, "h") == 0)
+            help();
+        else if (strcmp(cmd, "b") == 0 || strcmp(cmd, "d") == 0)
+            setbreak(arg, cmd[0] == 'b');
+        else if (strcmp(cmd, "w") == 0)
+            setwatch(vm, arg);
+        else if (strcmp(cmd, "f") == 0)
+            frame(vm);
+        else if (strcmp(cmd, "bt") == 0)
+            backtrace(vm);
+        else if (strcmp(cmd, "p") == 0)
+            printvar(vm, arg);
+        else if (strcmp(cmd, "l") == 0)
+            list(vm, arg);
+        else if (strcmp(cmd, "s") == 0 || strcmp(cmd, "c") == 0)
+        {
+            if (!vm->halt)
+                go(vm, cmd[0] == 's');
+            where(vm);
+        }
+        else
+            fprintf(out, "unknown command %s, h lists them\n", cmd);
+    }
+
+    free(orig);
+    free(wvar);
+    free(mark);
+}
@@ -0,0 +1,479 @@
+/* the instruction handlers of the vm, this gets included
+   by vm.c once for every dispatch loop it builds, the loop
+   defines OP to start a handler, NEXT to go to the next
+   instruction and HALT to stop the machine, and UNCHECKED
+   to 1 when the code has been verified so the stack and
+   pc don't need masking, the activation records printins
+   shows only get kept track of when TRACING is true, the
+   machine is vm but sp, bp, pc and stk are locals of the loop
+
+   the top of the stack is TOP and PUSH, POP and DROP change
+   it, a loop can keep it out of stk, SPILL writes it back for
+   the handlers that need the stack as it is in memory and
+   FILL loads it again after they moved sp
+
+   the handlers that can jump, call or return CHARGE the fuel
+   before going on, which can stop the machine there, a loop
+   can watch the conditional jumps with RECORD and the jumps
+   back to the top of a loop with LOOP */
+
+OP(XLIT) /* LIT 0, M */
+    PUSH(ir.m);
+    NEXT;
+
+OP(XRET) /* OPR 0, 0 */
+    if (TRACING)
+        vm->ar[SW(bp - 1)] = 0;
+
+    sp = SW(bp - 1);
+    pc = PW(stk[SW(sp + 4)]);
+    bp = stk[SW(sp + 3)];
+
+    if (TRACING)
+        vm->lastar = SW(bp + FRAME);
+
+    if (sp <= 0)
+    {
+        if (TRACING)
+        {
+            vm->lastar = 0;
+            TRACE;
+        }
+        vm->halt = 1;
+        HALT;
+    }
+    FILL;
+    CHARGE;
+    NEXT;
+
+OP(XNEG) /* OPR 0, 1 */
+    TOP = -TOP;
+    NEXT;
+
+OP(XADD) /* OPR 0, 2 */
+    v = POP();
+    TOP += v;
+    NEXT;
+
+OP(XSUB) /* OPR 0, 3 */
+    v = POP();
+    TOP -= v;
+    NEXT;
+
+OP(XMUL) /* OPR 0, 4 */
+    v = POP();
+    TOP *= v;
+    NEXT;
+
+OP(XDIV) /* OPR 0, 5 */
+    v = POP();
+    if (v == 0)
+        vmdie(vm, "vm: divide by 0");
+    TOP /= v;
+    NEXT;
+
+OP(XODD) /* OPR 0, 6 */
+    TOP %= 2;
+    NEXT;
+
+OP(XMOD) /* OPR 0, 7 */
+    v = POP();
+    if (v == 0)
+        vmdie(vm, "vm: mod by 0");
+    TOP %= v;
+    NEXT;
+
+OP(XEQL) /* OPR 0, 8 */
+    v = POP();
+    TOP = (TOP == v);
+    NEXT;
+
+OP(XNEQ) /* OPR 0, 9 */
+    v = POP();
+    TOP = (TOP != v);
+    NEXT;
+
+OP(XLSS) /* OPR 0, 10 */
+    v = POP();
+    TOP = (TOP < v);
+    NEXT;
+
+OP(XLEQ) /* OPR 0, 11 */
+    v = POP();
+    TOP = (TOP <= v);
+    NEXT;
+
+OP(XGTR) /* OPR 0, 12 */
+    v = POP();
+    TOP = (TOP > v);
+    NEXT;
+
+OP(XGEQ) /* OPR 0, 13 */
+    v = POP();
+    TOP = (TOP >= v);
+    NEXT;
+
+OP(XLOD) /* LOD L, M */
+    PUSH(stk[SW(BASE(ir.l, bp) + ir.m)]);
+    NEXT;
+
+OP(XSTO) /* STO L, M */
+    stk[SW(BASE(ir.l, bp) + ir.m)] = TOP;
+    DROP;
+    NEXT;
+
+OP(XCAL) /* CAL L, M */
+    SPILL;
+    stk[SW(sp + 1)] = 0;
+    stk[SW(sp + 2)] = BASE(ir.l, bp);
+    stk[SW(sp + 3)] = bp;
+    stk[SW(sp + 4)] = pc;
+    bp = SW(sp + 1);
+    pc = PW(ir.m);
+    ROOM;
+
+    if (TRACING)
+    {
+        vm->ar[SW(bp - 1)] = 1;
+        vm->lastar = SW(sp + FRAME);
+    }
+
+    if (bp <= 0)
+    {
+        vm->halt = 1;
+        HALT;
+    }
+    CHARGE;
+    NEXT;
+
+OP(XTCL) /* TCL 1, M */
+    stk[SW(bp)] = 0;
+    sp = SW(bp - 1);
+    FILL;
+    pc = PW(ir.m);
+    CHARGE;
+    NEXT;
+
+OP(XINC) /* INC 0, M */
+    SPILL;
+    sp = SW(sp + ir.m);
+    FILL;
+    NEXT;
+
+OP(XJMP) /* JMP 0, M */
+    pc = PW(ir.m);
+    CHARGE;
+    LOOP;
+    NEXT;
+
+OP(XJPC) /* JPC 0, M */
+    if (TOP == 0)
+        pc = PW(ir.m);
+    DROP;
+    RECORD;
+    CHARGE;
+    NEXT;
+
+OP(XSIO1) /* SIO 0, 1 */
+    fprintf(vm->out, "Value on top of the stack: %d\n", TOP);
+    vm->nwrite++;
+    DROP;
+    NEXT;
+
+OP(XSIO2) /* SIO 0, 2 */
+    PUSH(readin(vm));
+    NEXT;
+
+OP(XLDS) /* LDS 0, M */
+    stk[SW(sp + ir.m)] = TOP;
+    DROP;
+    NEXT;
+
+OP(XLODD) /* LOD L, M with L the level of the frame */
+    PUSH(stk[SW(vm->display[ir.l] + ir.m)]);
+    NEXT;
+
+OP(XSTOD) /* STO L, M with L the level of the frame */
+    stk[SW(vm->display[ir.l] + ir.m)] = TOP;
+    DROP;
+    NEXT;
+
+OP(XCALD) /* CAL L, M with L the level of the procedure */
+    SPILL;
+    stk[SW(sp + 1)] = 0;
+    stk[SW(sp + 2)] = vm->display[ir.l - 1];
+    stk[SW(sp + 3)] = bp;
+    stk[SW(sp + 4)] = pc;
+    bp = SW(sp + 1);
+    pc = PW(ir.m);
+    ROOM;
+
+    vm->dsave[vm->depth++ & vm->dmask] = vm->display[ir.l];
+    vm->display[ir.l] = bp;
+
+    if (TRACING)
+    {
+        vm->ar[SW(bp - 1)] = 1;
+        vm->lastar = SW(sp + FRAME);
+    }
+
+    if (bp <= 0)
+    {
+        vm->halt = 1;
+        HALT;
+    }
+    CHARGE;
+    NEXT;
+
+OP(XRETD) /* OPR 0, 0 with L the level of the procedure */
+    if (TRACING)
+        vm->ar[SW(bp - 1)] = 0;
+
+    sp = SW(bp - 1);
+    pc = PW(stk[SW(sp + 4)]);
+    bp = stk[SW(sp + 3)];
+
+    if (ir.l > 0 && vm->depth > 0)
+        vm->display[ir.l] = vm->dsave[--vm->depth & vm->dmask];
+
+    if (TRACING)
+        vm->lastar = SW(bp + FRAME);
+
+    if (sp <= 0)
+    {
+        if (TRACING)
+        {
+            vm->lastar = 0;
+            TRACE;
+        }
+        vm->halt = 1;
+        HALT;
+    }
+    FILL;
+    CHARGE;
+    NEXT;
+
+OP(XBAD)
+    badins(vm);
+    vm->halt = 1;
+    HALT;
+
+/* the superinstructions fuse() makes, the variables the
+   ones on variables use can be the slot TOP is cached from */
+
+OP(XADDVV) /* LOD, LOD, OPR ADD, STO */
+    SPILL;
+    s = &sup[ir.m];
+    stk[SW(vm->display[s->l3] + s->m3)] = stk[SW(vm->display[s->l1] + s->m1)] + stk[SW(vm->display[s->l2] + s->m2)];
+    FILL;
+    NEXT;
+
+OP(XSUBVV) /* LOD, LOD, OPR SUB, STO */
+    SPILL;
+    s = &sup[ir.m];
+    stk[SW(vm->display[s->l3] + s->m3)] = stk[SW(vm->display[s->l1] + s->m1)] - stk[SW(vm->display[s->l2] + s->m2)];
+    FILL;
+    NEXT;
+
+OP(XMULVV) /* LOD, LOD, OPR MUL, STO */
+    SPILL;
+    s = &sup[ir.m];
+    stk[SW(vm->display[s->l3] + s->m3)] = stk[SW(vm->display[s->l1] + s->m1)] * stk[SW(vm->display[s->l2] + s->m2)];
+    FILL;
+    NEXT;
+
+OP(XADDVK) /* LOD, LIT, OPR ADD, STO */
+    SPILL;
+    s = &sup[ir.m];
+    stk[SW(vm->display[s->l3] + s->m3)] = stk[SW(vm->display[s->l1] + s->m1)] + s->m2;
+    FILL;
+    NEXT;
+
+OP(XSUBVK) /* LOD, LIT, OPR SUB, STO */
+    SPILL;
+    s = &sup[ir.m];
+    stk[SW(vm->display[s->l3] + s->m3)] = stk[SW(vm->display[s->l1] + s->m1)] - s->m2;
+    FILL;
+    NEXT;
+
+OP(XADDK) /* LIT 0, M; OPR 0, ADD */
+    TOP += ir.m;
+    NEXT;
+
+OP(XSUBK)
+    TOP -= ir.m;
+    NEXT;
+
+OP(XMULK)
+    TOP *= ir.m;
+    NEXT;
+
+OP(XDIVK)
+    if (ir.m == 0)
+        vmdie(vm, "vm: divide by 0");
+    TOP /= ir.m;
+    NEXT;
+
+OP(XMODK)
+    if (ir.m == 0)
+        vmdie(vm, "vm: mod by 0");
+    TOP %= ir.m;
+    NEXT;
+
+OP(XEQLK)
+    TOP = (TOP == ir.m);
+    NEXT;
+
+OP(XNEQK)
+    TOP = (TOP != ir.m);
+    NEXT;
+
+OP(XLSSK)
+    TOP = (TOP < ir.m);
+    NEXT;
+
+OP(XLEQK)
+    TOP = (TOP <= ir.m);
+    NEXT;
+
+OP(XGTRK)
+    TOP = (TOP > ir.m);
+    NEXT;
+
+OP(XGEQK)
+    TOP = (TOP >= ir.m);
+    NEXT;
+
+OP(XJEQL) /* OPR 0, EQL; JPC 0, M */
+    v = POP();
+    if (!(POP() == v))
+        pc = ir.m;
+    RECORD;
+    CHARGE;
+    NEXT;
+
+OP(XJNEQ)
+    v = POP();
+    if (!(POP() != v))
+        pc = ir.m;
+    RECORD;
+    CHARGE;
+    NEXT;
+
+OP(XJLSS)
+    v = POP();
+    if (!(POP() < v))
+        pc = ir.m;
+    RECORD;
+    CHARGE;
+    NEXT;
+
+OP(XJLEQ)
+    v = POP();
+    if (!(POP() <= v))
+        pc = ir.m;
+    RECORD;
+    CHARGE;
+    NEXT;
+
+OP(XJGTR)
+    v = POP();
+    if (!(POP() > v))
+        pc = ir.m;
+    RECORD;
+    CHARGE;
+    NEXT;
+
+OP(XJGEQ)
+    v = POP();
+    if (!(POP() >= v))
+        pc = ir.m;
+    RECORD;
+    CHARGE;
+    NEXT;
+
+OP(XJODD) /* OPR 0, ODD; JPC 0, M */
+    if (POP() % 2 == 0)
+        pc = ir.m;
+    RECORD;
+    CHARGE;
+    NEXT;
+
+OP(XJEQLK) /* LIT 0, L; OPR 0, EQL; JPC 0, M */
+    if (!(POP() == ir.l))
+        pc = ir.m;
+    RECORD;
+    CHARGE;
+    NEXT;
+
+OP(XJNEQK)
+    if (!(POP() != ir.l))
+        pc = ir.m;
+    RECORD;
+    CHARGE;
+    NEXT;
+
+OP(XJLSSK)
+    if (!(POP() < ir.l))
+        pc = ir.m;
+    RECORD;
+    CHARGE;
+    NEXT;
+
+OP(XJLEQK)
+    if (!(POP() <= ir.l))
+        pc = ir.m;
+    RECORD;
+    CHARGE;
+    NEXT;
+
+OP(XJGTRK)
+    if (!(POP() > ir.l))
+        pc = ir.m;
+    RECORD;
+    CHARGE;
+    NEXT;
+
+OP(XJGEQK)
+    if (!(POP() >= ir.l))
+        pc = ir.m;
+    RECORD;
+    CHARGE;
+    NEXT;
+
+OP(XLODS) /* LOD L, M; LDS 0, M */
+    SPILL;
+    s = &sup[ir.m];
+    stk[SW(sp + 1 + s->m2)] = stk[SW(vm->display[s->l1] + s->m1)];
+    NEXT;
+
+OP(XLITS) /* LIT 0, L; LDS 0, M */
+    stk[SW(sp + 1 + ir.m)] = ir.l;
+    NEXT;
+
+/* the quickened ones, quicken() makes them after the fusing */
+
+OP(XLOD0) /* LOD L, M of the frame of the procedure it is in */
+    PUSH(stk[SW(bp + ir.m)]);
+    NEXT;
+
+OP(XSTO0) /* STO L, M of the frame of the procedure it is in */
+    stk[SW(bp + ir.m)] = TOP;
+    DROP;
+    NEXT;
+
+OP(XLIT0) /* LIT 0, 0 */
+    PUSH(0);
+    NEXT;
+
+OP(XLIT1) /* LIT 0, 1 */
+    PUSH(1);
+    NEXT;
+
+/* a breakpoint the debugger patched over the instruction at
+   oldpc, stop before it runs and let the debugger have it */
+OP(XTRAP)
+    pc = vm->oldpc;
+    vm->trap = 1;
+    fuel -= RAN - 1;
+    YIELD;
@@ -2,14 +2,88 @@
 
 #define nelem(x)  ((int)(sizeof(x)/sizeof((x)[0])))
 #define max(a, b) ((a) > (b) ? (a) : (b))
+#define min(a, b) ((a) < (b) ? (a) : (b))
 
 void     *emalloc      (size_t);
 void      die          (char*, ...);
 
 void      loadinsfile  (char*);
-void      loadinsbuf   (Ins*, int);
+void      loadinsbuf   (Code*, int);
+void      loadlines    (Loc*, char*);
 void      writeinsfile (char*);
+void      writeobjfile (char*);
+void      writecfile   (char*);
 void      execute      (void);
+Prog     *takeprog     (void);
+VM       *newvm        (void);
+void      freevm       (VM*);
+void      vmreset      (VM*, Prog*, FILE*, FILE*, FILE*);
+VM       *clonevm      (VM*);
+void      stkgrow      (VM*, int);
+int       stkspan      (void);
+int       runvm        (VM*, long long);
+int       readin       (VM*);
+void      badins       (VM*);
+void      printins     (VM*, int);
+char     *opname       (int);
+void      patchins     (Prog*, int, Xins*);
+void      debug        (VM*);
+void      profopen     (char*, Prog*);
+void      profput      (VM*);
+void      profclose    (void);
+void      sampleopen   (VM*);
+void      sampleclose  (void);
+void      teleopen     (VM*);
+void      teleput      (VM*, int);
+void      teleclose    (void);
+int       teletop      (int, int);
+void      vmdie        (VM*, char*, ...);
+double    clockms      (int);
+
+int       batch        (char*, int, int);
+void      ringopen     (char*, Prog*);
+void      ringput      (VM*);
+void      ringclose    (void);
+int       ringdecode   (char*);
+int       readnum      (void);
+int       decode       (Ins*);
+int       verify       (Ins*, int, int*, int);
+
+int       fuse         (Ins*, unsigned char*, int, Xins*, int*, Sup*, int);
+
+Code      pack         (Ins*);
+void      unpack       (Code, Ins*);
+void      poolreset    (void);
+void      poolset      (Ins*, int);
+Ins      *poolget      (int*);
+int       ispooled     (Code);
+
+int       isobj        (char*);
+void      writeobj     (char*, Code*, int);
+Code     *mapobj       (char*, int*);
+uint32_t  fnv          (uint32_t, void*, size_t);
+
+int       savesnap     (VM*, char*);
+int       loadsnap     (VM*, char*);
+
+int       writec       (char*, Prog*);
+
+int       regtrans     (Ins*, int, int);
+void      regexec      (int*);
+int       ctlexec      (VM*, Prog*);
+
+int       jitcompile   (Ins*, int, int);
+void      jitexec      (int*);
+Trace    *tracegen     (VM*, int*, int);
+void      tracefree    (Trace*);
+
+Cl       *clcompile    (Prog*);
+void      runclosure   (VM*);
+
+Jit      *newjit       (int);
+void      freejit      (Jit*, int);
+void      tracebranch  (Jit*, int);
+int       traceloop    (VM*, int, int, long long*);
 
 void      newfile      (char*);
 int       lex          (void);
@@ -25,3 +99,7 @@ void      pushproc     (Sym*);
 void      popproc      (void);
 void      compile      (char*);
 void      emit         (int, int, int);
+void      patch        (int, int);
+void      tailcall     (int, int);
+int       mapsym       (Sym*, int);
+int       mapproc      (int);
@@ -0,0 +1,225 @@
+#include "dat.h"
+#include "fns.h"
+
+/* the superinstruction pass, it runs over the code when it gets
+   loaded and turns the sequences the parser generates the most
+   into single instructions, so the dispatch loops go through
+   a lot less dispatches for the same work:
+
+   LOD, LOD, OPR, STO   x := y op z               XADDVV ...
+   LOD, LIT, OPR, STO   x := y op k               XADDVK ...
+   LIT, OPR             op with a constant         XADDK ...
+   OPR, JPC             condition of a if/while    XJLSS ...
+   LIT, OPR, JPC        the same with a constant   XJLSSK ...
+   LOD/LIT, LDS         passing a argument         XLODS, XLITS
+
+   nothing inside a sequence can be the target of a jump, the
+   sequences get compacted and the jumps and calls remapped, the
+   ones that load and store variables go through the display so
+   they only get made when the code has been set up for it
+*/
+
+enum
+{
+    FVV, FVK, FK, FJ, FJK, FLDS, NFUSE
+};
+
+static char *fname[] =
+{
+    [FVV]  = "lod lod opr sto",
+    [FVK]  = "lod lit opr sto",
+    [FK]   = "lit opr",
+    [FJ]   = "opr jpc",
+    [FJK]  = "lit opr jpc",
+    [FLDS] = "lod/lit lds"
+};
+
+static int pw(int v)
+{
+    return v & (MAX_CODE_LENGTH-1);
+}
+
+/* is p a OPR m with m between lo and hi */
+static int isopr(Ins *p, int lo, int hi)
+{
+    return p->op == OOPR && p->m >= lo && p->m <= hi;
+}
+
+static int isrel(Ins *p)
+{
+    return isopr(p, OEQL, OGEQ);
+}
+
+static int isbin(Ins *p)
+{
+    return isopr(p, OADD, OSUB) || isopr(p, OMUL, ODIV) || isopr(p, OMOD, OGEQ);
+}
+
+/* the binary ops with a constant right side */
+static int kop(int m)
+{
+    static const unsigned char ops[] =
+    {
+        [OADD] = XADDK, [OSUB] = XSUBK, [OMUL] = XMULK, [ODIV] = XDIVK,
+        [OMOD] = XMODK, [OEQL] = XEQLK, [ONEQ] = XNEQK, [OLSS] = XLSSK,
+        [OLEQ] = XLEQK, [OGTR] = XGTRK, [OGEQ] = XGEQK
+    };
+
+    return ops[m];
+}
+
+/* does v fit in the L of a Xins */
+static int fitsl(int v)
+{
+    return v >= -(1 << 23) && v < (1 << 23);
+}
+
+static int isjump(int op)
+{
+    return op == XJMP || op == XJPC || op == XCAL || op == XCALD || op == XTCL || (op >= XJEQL && op <= XJGEQK);
+}
+
+/* fuse the code in ins, already decoded into dec, into out
+   and op, the extra operands go into sup and the pc every
+   fused instruction came from into src, returns the length
+   of the fused code */
+int fuse(Ins *ins, unsigned char *dec, int len, Xins *out, int *src, Sup *sup, int display)
+{
+    Ins *p;
+    Xins *o;
+    Sup *s;
+    char *label;
+    int *map;
+    int count[NFUSE];
+    int pc, n, ns, k, t, i;
+
+    label = emalloc(len + 1);
+    map = emalloc(sizeof(map[0]) * (len + 1));
+    memset(count, 0, sizeof(count));
+
+    for (pc = 0; pc < len; pc++)
+    {
+        p = &ins[pc];
+        t = pw(p->m);
+        if ((p->op == OJMP || p->op == OJPC || p->op == OCAL || p->op == OTCL) && t < len)
+            label[t] = 1;
+        if (p->op == OCAL)
+            label[pc + 1] = 1;
+    }
+
+    n = 0;
+    ns = 0;
+    for (pc = 0; pc < len; pc += k)
+    {
+        p = &ins[pc];
+        o = &out[n];
+        map[pc] = n;
+        src[n] = pc;
+
+        /* how long of a sequence can start here */
+        for (k = 1; k < 4 && pc + k < len && !label[pc + k]; k++)
+            ;
+
+        if (k >= 4 && display && dec[pc] == XLODD &&
+            (dec[pc + 1] == XLODD || p[1].op == OLIT) &&
+            (isopr(&p[2], OADD, OSUB) || (p[1].op == OLOD && isopr(&p[2], OMUL, OMUL))) &&
+            dec[pc + 3] == XSTOD)
+        {
+            s = &sup[ns];
+            s->l1 = p[0].l;
+            s->m1 = p[0].m;
+            s->l2 = p[1].l;
+            s->m2 = p[1].m;
+            s->l3 = p[3].l;
+            s->m3 = p[3].m;
+
+            o->l = 0;
+            o->m = ns++;
+            if (p[1].op == OLOD)
+            {
+                o->op = XADDVV + (p[2].m - OADD);
+                count[FVV]++;
+            }
+            else
+            {
+                o->op = XADDVK + (p[2].m - OADD);
+                count[FVK]++;
+            }
+            k = 4;
+        }
+        else if (k >= 3 && p[0].op == OLIT && fitsl(p[0].m) && isrel(&p[1]) && p[2].op == OJPC)
+        {
+            o->op = XJEQLK + (p[1].m - OEQL);
+            o->l = p[0].m;
+            o->m = p[2].m;
+            count[FJK]++;
+            k = 3;
+        }
+        else if (k >= 2 && (isrel(&p[0]) || isopr(&p[0], OODD, OODD)) && p[1].op == OJPC)
+        {
+            o->op = (p[0].m == OODD) ? XJODD : XJEQL + (p[0].m - OEQL);
+            o->l = 0;
+            o->m = p[1].m;
+            count[FJ]++;
+            k = 2;
+        }
+        else if (k >= 2 && p[0].op == OLIT && isbin(&p[1]))
+        {
+            o->op = kop(p[1].m);
+            o->l = 0;
+            o->m = p[0].m;
+            count[FK]++;
+            k = 2;
+        }
+        else if (k >= 2 && ((display && dec[pc] == XLODD) || (p[0].op == OLIT && fitsl(p[0].m))) && p[1].op == OLDS)
+        {
+            if (p[0].op == OLOD)
+            {
+                s = &sup[ns];
+                s->l1 = p[0].l;
+                s->m1 = p[0].m;
+                s->m2 = p[1].m;
+                o->op = XLODS;
+                o->l = 0;
+                o->m = ns++;
+            }
+            else
+            {
+                o->op = XLITS;
+                o->l = p[0].m;
+                o->m = p[1].m;
+            }
+            count[FLDS]++;
+            k = 2;
+        }
+        else
+        {
+            o->op = fitsl(p->l) ? dec[pc] : XBAD;
+            o->l = p->l;
+            o->m = p->m;
+            k = 1;
+        }
+        n++;
+    }
+
+    /* everything that jumps has to go to the fused code now,
+       jumps out of the code go to the bad instruction after it */
+    for (i = 0; i < n; i++)
+    {
+        if (!isjump(out[i].op))
+            continue;
+        t = pw(out[i].m);
+        out[i].m = (t < len) ? map[t] : n;
+    }
+
+    if (showfuse)
+    {
+        fprintf(stderr, "fuse: %d instructions fused into %d\n", len, n);
+        for (i = 0; i < NFUSE; i++)
+            fprintf(stderr, "fuse: %8d %s\n", count[i], fname[i]);
+    }
+
+    free(label);
+    free(map);
+    return n;
+}
@@ -26,9 +26,17 @@ static Call ctab[MAX_CODE_LENGTH];
 static int  clen;
 
 /* instruction buffer we generate code into */
-Ins code[MAX_CODE_LENGTH];
+Code code[MAX_CODE_LENGTH];
 int codepos;
 
+/* the source position of every instruction in code */
+Loc loc[MAX_CODE_LENGTH];
+
+/* every name declared, for the debugger */
+Dsym *dsym;
+int   ndsym;
+static int dcap;
+
 /* push a unresolved call to the table */
 void pushcall(Sym *s)
 {
@@ -54,10 +62,10 @@ static void fixcall(Sym *s)
         c = &ctab[i];
         if (strcmp(c->sym->name, s->name) == 0)
         {
-            code[c->pos].m = s->addr;
+            patch(c->pos, s->addr);
 
-            *c = ctab[j];
-            j--;
+            /* the last live call takes its place */
+            *c = ctab[--j];
             continue;
         }
 
@@ -67,6 +75,43 @@ static void fixcall(Sym *s)
     clen = j;
 }
 
+/* add a name declared in procedure proc to the map, returns
+   where it is in it */
+int mapsym(Sym *s, int proc)
+{
+    Dsym *d;
+
+    if (ndsym >= dcap)
+    {
+        dcap = max(dcap * 2, 64);
+        dsym = realloc(dsym, sizeof(dsym[0]) * dcap);
+        if (!dsym)
+            die("oom trying to grow the symbol map");
+    }
+
+    d = &dsym[ndsym];
+    d->sym = *s;
+    d->proc = proc;
+    d->start = -1;
+    d->end = -1;
+    return ndsym++;
+}
+
+/* the procedure in the map the code at pc is the body of, the
+   jumps over the procedures are the main program's, -1 when
+   there is no map, like for code loaded with -p */
+int mapproc(int pc)
+{
+    int i;
+
+    for (i = 0; i < ndsym; i++)
+    {
+        if (dsym[i].sym.type == symproc && dsym[i].start <= pc && pc < dsym[i].end)
+            return i;
+    }
+    return (ndsym > 0) ? 0 : -1;
+}
+
 /* push unresolved procedure to table */
 void pushproc(Sym *s)
 {
@@ -92,21 +137,73 @@ void popproc(void)
 /* emit an instruction to the code buffer */
 void emit(int op, int l, int m)
 {
-    Ins *i;
+    Ins i;
 
     if (codepos >= MAX_CODE_LENGTH)
         die("internal error: exceeded max code buffer size");
 
-    i = &code[codepos++];
-    i->op = op;
-    i->l = l;
-    i->m = m;
+    i.op = op;
+    i.l = l;
+    i.m = m;
+    loc[codepos].line = line;
+    loc[codepos].col = pos;
+    code[codepos++] = pack(&i);
+}
+
+/* set the M of a instruction emitted before, for jumps
+   and calls that didn't know where they go yet */
+void patch(int pos, int m)
+{
+    Ins i;
+
+    unpack(code[pos], &i);
+    i.m = m;
+    code[pos] = pack(&i);
+}
+
+/* make the CAL at at a tail call, the arguments from start on
+   are each a expression and a LDS into the new frame, with the
+   LDSs dropped the values stay on the stack and get stored into
+   the frame the call reuses last to first, so none of them is
+   overwritten before all of them are worked out */
+void tailcall(int start, int at)
+{
+    Ins i;
+    int pc, n, k;
+
+    n = start;
+    k = 0;
+    for (pc = start; pc < at; pc++)
+    {
+        unpack(code[pc], &i);
+        if (i.op == OLDS)
+        {
+            k++;
+            continue;
+        }
+        loc[n] = loc[pc];
+        code[n++] = code[pc];
+    }
+
+    while (k-- > 0)
+    {
+        i.op = OSTO;
+        i.l = 0;
+        i.m = FRAME + k;
+        loc[n] = loc[at];
+        code[n++] = pack(&i);
+    }
+
+    unpack(code[at], &i);
+    i.op = OTCL;
+    code[at] = pack(&i);
 }
 
 /* linking stage */
 static void link(void)
 {
     loadinsbuf(code, codepos);
+    loadlines(loc, ion);
 }
 
 /* compiles a source file and runs it, if any
@@ -134,8 +231,9 @@ void compile(char *f)
 
     plen = 0;
     clen = 0;
-    memset(ptab, 0, sizeof(ptab));
-    memset(ctab, 0, sizeof(ctab));
+    codepos = 0;
+    ndsym = 0;
+    poolreset();
 
     if (parse() < 0)
         die("Encountered error(s) in the parsing stage, aborting");
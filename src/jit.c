@@ -0,0 +1,1082 @@
+#define _DEFAULT_SOURCE
+#include "dat.h"
+#include "fns.h"
+
+/* the x86-64 jit, every vm instruction gets turned into
+   a short sequence of machine code, while the vm registers
+   live in machine registers for the whole run:
+
+   rbx  the stack
+   r12d sp
+   r13d bp
+   r14  native address of every instruction, for RET
+   eax  the top of the stack, when it hasn't been stored yet
+
+   the stack indices get masked the same way the interpreter
+   does so the generated code behaves exactly like it
+*/
+
+#if defined(__x86_64__) && defined(__unix__)
+
+#include <sys/mman.h>
+
+typedef struct Fix Fix;
+typedef void (*Fn)(void);
+
+/* a rel32 jump that needs the address of instruction pc */
+struct Fix
+{
+    int off;
+    int pc;
+};
+
+enum
+{
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+/* x86 condition codes */
+enum
+{
+    CE = 0x4, CNE = 0x5, CL = 0xc, CGE = 0xd, CLE = 0xe, CG = 0xf
+};
+
+#define PMASK (MAX_CODE_LENGTH-1)
+
+/* the deepest static link walk we generate inline */
+#define MAXL 16
+
+/* code buffer being generated */
+static unsigned char *buf;
+static int blen;
+static int bcap;
+
+static int *noff;
+static int *ent;
+static char *label;
+static char *tosat;
+static int  tos;
+static int  smask;
+static Fix *fix;
+static int  nfix;
+static int  fcap;
+
+/* the finished code */
+static unsigned char *jitmem;
+static size_t jitsize;
+static void **jittab;
+static int jitlen;
+static Ins *jitins;
+static int jittop;
+
+static void b1(int c)
+{
+    if (blen >= bcap)
+    {
+        bcap = max(bcap * 2, 4096);
+        buf = realloc(buf, bcap);
+        if (!buf)
+            die("oom trying to allocate jit buffer");
+    }
+    buf[blen++] = c;
+}
+
+static void b4(int v)
+{
+    b1(v & 0xff);
+    b1((v >> 8) & 0xff);
+    b1((v >> 16) & 0xff);
+    b1((v >> 24) & 0xff);
+}
+
+static void b8(unsigned long long v)
+{
+    b4((int)(v & 0xffffffff));
+    b4((int)(v >> 32));
+}
+
+static void rex(int w, int r, int x, int b)
+{
+    int v;
+
+    v = 0x40 | (w << 3) | ((r >> 3) << 2) | ((x >> 3) << 1) | (b >> 3);
+    if (v != 0x40)
+        b1(v);
+}
+
+/* op reg, [rbx + idx*4] */
+static void xmem(int op, int reg, int idx)
+{
+    rex(0, reg, idx, RBX);
+    b1(op);
+    b1(((reg & 7) << 3) | 4);
+    b1(0x80 | ((idx & 7) << 3) | RBX);
+}
+
+/* mov reg, stk[idx] */
+static void load(int reg, int idx)
+{
+    xmem(0x8b, reg, idx);
+}
+
+/* mov stk[idx], reg */
+static void store(int idx, int reg)
+{
+    xmem(0x89, reg, idx);
+}
+
+/* mov dst, src */
+static void movrr(int dst, int src)
+{
+    rex(0, src, 0, dst);
+    b1(0x89);
+    b1(0xc0 | ((src & 7) << 3) | (dst & 7));
+}
+
+/* mov reg, imm */
+static void movri(int reg, int imm)
+{
+    rex(0, 0, 0, reg);
+    b1(0xb8 + (reg & 7));
+    b4(imm);
+}
+
+/* add/or/and/sub/cmp reg, imm, ext is the /digit of the op */
+static void alu(int ext, int reg, int imm)
+{
+    rex(0, 0, 0, reg);
+    if (imm >= -128 && imm <= 127)
+    {
+        b1(0x83);
+        b1(0xc0 | (ext << 3) | (reg & 7));
+        b1(imm);
+    }
+    else
+    {
+        b1(0x81);
+        b1(0xc0 | (ext << 3) | (reg & 7));
+        b4(imm);
+    }
+}
+
+/* reg = sw(reg + v) */
+static void addmask(int reg, int v)
+{
+    if (v != 0)
+        alu(0, reg, v);
+    alu(4, reg, smask);
+}
+
+/* dst = sw(src + v) */
+static void lea(int dst, int src, int v)
+{
+    movrr(dst, src);
+    addmask(dst, v);
+}
+
+/* test reg, reg */
+static void test(int reg)
+{
+    rex(0, reg, 0, reg);
+    b1(0x85);
+    b1(0xc0 | ((reg & 7) << 3) | (reg & 7));
+}
+
+/* call a c function */
+static void call(Fn fn)
+{
+    unsigned long long v;
+
+    v = 0;
+    memcpy(&v, &fn, sizeof(fn));
+    b1(0x48);
+    b1(0xb8);
+    b8(v);
+    b1(0xff);
+    b1(0xd0);
+}
+
+/* a jump to instruction pc, cc < 0 is unconditional */
+static void jump(int cc, int pc)
+{
+    Fix *f;
+
+    if (cc < 0)
+        b1(0xe9);
+    else
+    {
+        b1(0x0f);
+        b1(0x80 | cc);
+    }
+
+    if (nfix >= fcap)
+    {
+        fcap = max(fcap * 2, 1024);
+        fix = realloc(fix, fcap * sizeof(fix[0]));
+        if (!fix)
+            die("oom trying to allocate jit fixups");
+    }
+    f = &fix[nfix++];
+    f->off = blen;
+    f->pc = pc;
+    b4(0);
+}
+
+/* edx = base(l, bp) */
+static void base(int l)
+{
+    movrr(RDX, R13);
+    while (l-- > 0)
+    {
+        addmask(RDX, 1);
+        load(RDX, RDX);
+        alu(4, RDX, smask);
+    }
+}
+
+/* helpers the generated code calls */
+static void jitwrite(int v)
+{
+    printf("Value on top of the stack: %d\n", v);
+}
+
+static void jitdiv0(void)
+{
+    die("vm: divide by 0");
+}
+
+static void jitmod0(void)
+{
+    die("vm: mod by 0");
+}
+
+static void jitover(int pc)
+{
+    die("vm: stack overflow at pc %d", pc);
+}
+
+static void jitbad(int pc)
+{
+    Ins *p;
+
+    p = &jitins[pc & PMASK];
+    fprintf(stderr, "vm: unknown instruction: OP: %d L: %d M: %d\n", p->op, p->l, p->m);
+}
+
+/* the epilogue is always at offset 0 */
+static void exit_(void)
+{
+    b1(0xe9);
+    b4(0 - (blen + 4));
+}
+
+/* report a bad instruction at pc and stop */
+static void bad(int pc)
+{
+    movri(RDI, pc);
+    call((Fn)jitbad);
+    exit_();
+}
+
+/* a short forward jump with opcode op, land() sets where it goes */
+static int skip(int op)
+{
+    b1(op);
+    b1(0);
+    return blen;
+}
+
+static void land(int at)
+{
+    if (blen - at > 127)
+        die("internal error: jit short jump too long");
+    buf[at - 1] = blen - at;
+}
+
+/* the top of the stack can stay in eax between instructions,
+   this writes it out to the stack if it is */
+static void flush(void)
+{
+    if (tos)
+        store(R12, RAX);
+    tos = 0;
+}
+
+/* eax = the top of the stack */
+static void top(void)
+{
+    if (!tos)
+        load(RAX, R12);
+}
+
+/* ecx = the popped top of the stack, eax = the new top */
+static void pop2(void)
+{
+    if (tos)
+        movrr(RCX, RAX);
+    else
+        load(RCX, R12);
+    addmask(R12, -1);
+    load(RAX, R12);
+}
+
+static void relop(int cc)
+{
+    pop2();
+    b1(0x39); b1(0xc8);               /* cmp eax, ecx */
+    b1(0x0f); b1(0x90 | cc); b1(0xc0); /* setcc al */
+    b1(0x0f); b1(0xb6); b1(0xc0);     /* movzx eax, al */
+    tos = 1;
+}
+
+static void arith(int m)
+{
+    int i;
+
+    pop2();
+    switch (m)
+    {
+        case OADD:
+            b1(0x01); b1(0xc8);
+            break;
+
+        case OSUB:
+            b1(0x29); b1(0xc8);
+            break;
+
+        case OMUL:
+            b1(0x0f); b1(0xaf); b1(0xc1);
+            break;
+
+        case ODIV:
+        case OMOD:
+            test(RCX);
+            i = skip(0x75);
+            call((m == ODIV) ? jitdiv0 : jitmod0);
+            land(i);
+            b1(0x99);                 /* cdq */
+            b1(0xf7); b1(0xf9);       /* idiv ecx */
+            if (m == OMOD)
+                movrr(RAX, RDX);
+            break;
+    }
+    tos = 1;
+}
+
+/* generate code for one instruction */
+static int gen(Ins *p, int pc)
+{
+    int i, t;
+
+    t = p->m & PMASK;
+    switch (p->op)
+    {
+        case OLIT:
+            flush();
+            addmask(R12, 1);
+            movri(RAX, p->m);
+            tos = 1;
+            break;
+
+        case OOPR:
+            switch (p->m)
+            {
+                case ORET:
+                    tos = 0;
+                    lea(R12, R13, -1);
+                    lea(RCX, R12, 4);
+                    load(RAX, RCX);
+                    lea(RCX, R12, 3);
+                    load(R13, RCX);
+                    test(R12);
+                    b1(0x0f); b1(0x84); b4(0 - (blen + 4)); /* jz exit */
+                    alu(7, RAX, jitlen);
+                    i = skip(0x72);   /* jb, a return to code we have */
+                    movrr(RDI, RAX);
+                    call((Fn)jitbad);
+                    exit_();
+                    land(i);
+                    b1(0x41); b1(0xff); b1(0x24); b1(0xc6); /* jmp [r14+rax*8] */
+                    break;
+
+                case ONEG:
+                    top();
+                    b1(0xf7); b1(0xd8);
+                    tos = 1;
+                    break;
+
+                case OODD:
+                    top();
+                    movri(RCX, 2);
+                    b1(0x99);
+                    b1(0xf7); b1(0xf9);
+                    movrr(RAX, RDX);
+                    tos = 1;
+                    break;
+
+                case OADD: case OSUB: case OMUL: case ODIV: case OMOD:
+                    arith(p->m);
+                    break;
+
+                case OEQL: relop(CE);  break;
+                case ONEQ: relop(CNE); break;
+                case OLSS: relop(CL);  break;
+                case OLEQ: relop(CLE); break;
+                case OGTR: relop(CG);  break;
+                case OGEQ: relop(CGE); break;
+
+                default:
+                    flush();
+                    bad(pc);
+                    break;
+            }
+            break;
+
+        case OLOD:
+            if (p->l > MAXL)
+                return -1;
+            flush();
+            base(p->l);
+            addmask(RDX, p->m);
+            load(RAX, RDX);
+            addmask(R12, 1);
+            tos = 1;
+            break;
+
+        case OSTO:
+            if (p->l > MAXL)
+                return -1;
+            top();
+            base(p->l);
+            addmask(RDX, p->m);
+            store(RDX, RAX);
+            addmask(R12, -1);
+            tos = 0;
+            break;
+
+        case OCAL:
+            if (p->l > MAXL)
+                return -1;
+            flush();
+            base(p->l);
+            lea(RCX, R12, 1);
+            xmem(0xc7, 0, RCX);
+            b4(0);
+            lea(RCX, R12, 2);
+            store(RCX, RDX);
+            lea(RCX, R12, 3);
+            store(RCX, R13);
+            lea(RCX, R12, 4);
+            xmem(0xc7, 0, RCX);
+            b4((pc + 1) & PMASK);
+            lea(R13, R12, 1);
+            if (jittop > 0)
+            {
+                alu(7, R13, stacklimit - jittop);
+                i = skip(0x7e);
+                movri(RDI, pc);
+                call((Fn)jitover);
+                land(i);
+            }
+            test(R13);
+            b1(0x0f); b1(0x84); b4(0 - (blen + 4)); /* jz exit */
+            if (t < jitlen)
+                jump(-1, t);
+            else
+                bad(t);
+            break;
+
+        case OTCL:
+            flush();
+            xmem(0xc7, 0, R13);
+            b4(0);
+            lea(R12, R13, -1);
+            if (t < jitlen)
+                jump(-1, t);
+            else
+                bad(t);
+            break;
+
+        case OINC:
+            flush();
+            addmask(R12, p->m);
+            break;
+
+        case OJMP:
+            flush();
+            if (t < jitlen)
+                jump(-1, t);
+            else
+                bad(t);
+            break;
+
+        case OJPC:
+            top();
+            addmask(R12, -1);
+            tos = 0;
+            test(RAX);
+            if (t < jitlen)
+                jump(CE, t);
+            else
+            {
+                i = skip(0x75);
+                bad(t);
+                land(i);
+            }
+            break;
+
+        case OSIO1:
+            top();
+            movrr(RDI, RAX);
+            call((Fn)jitwrite);
+            addmask(R12, -1);
+            tos = 0;
+            break;
+
+        case OSIO2:
+            flush();
+            addmask(R12, 1);
+            call((Fn)readnum);
+            tos = 1;
+            break;
+
+        case OLDS:
+            top();
+            lea(RCX, R12, p->m);
+            store(RCX, RAX);
+            addmask(R12, -1);
+            tos = 0;
+            break;
+
+        default:
+            flush();
+            bad(pc);
+            break;
+    }
+    return 0;
+}
+
+/* mark the instructions jumps and calls go to, the top
+   of the stack has to be in memory when we get there */
+static void labels(Ins *ins, int len)
+{
+    Ins *p;
+    int pc, t;
+
+    memset(label, 0, len + 1);
+    for (pc = 0; pc < len; pc++)
+    {
+        p = &ins[pc];
+        t = p->m & PMASK;
+        if ((p->op == OJMP || p->op == OJPC || p->op == OCAL || p->op == OTCL) && t < len)
+            label[t] = 1;
+        if (p->op == OCAL)
+            label[pc + 1] = 1;
+    }
+}
+
+/* compile the code, returns -1 if it can't, top is how much
+   stack a frame can use when it is known, CAL checks for it */
+int jitcompile(Ins *ins, int len, int top)
+{
+    Fix *f;
+    int pc, i;
+
+    blen = 0;
+    nfix = 0;
+    jitlen = len;
+    jitins = ins;
+    jittop = top;
+    smask = stkspan() - 1;
+    noff = emalloc(sizeof(noff[0]) * (len + 1));
+    ent = emalloc(sizeof(ent[0]) * (len + 1));
+    label = emalloc(len + 1);
+    tosat = emalloc(len + 1);
+    labels(ins, len);
+
+    /* epilogue, everything that stops jumps back here */
+    b1(0x48); b1(0x83); b1(0xc4); b1(0x08);  /* add rsp, 8 */
+    b1(0x41); b1(0x5f);                      /* pop r15 */
+    b1(0x41); b1(0x5e);                      /* pop r14 */
+    b1(0x41); b1(0x5d);                      /* pop r13 */
+    b1(0x41); b1(0x5c);                      /* pop r12 */
+    b1(0x5d);                                /* pop rbp */
+    b1(0x5b);                                /* pop rbx */
+    b1(0xc3);                                /* ret */
+
+    /* prologue, jitexec calls it with the stack and the table */
+    noff[len] = blen;
+    b1(0x53);                                /* push rbx */
+    b1(0x55);                                /* push rbp */
+    b1(0x41); b1(0x54);                      /* push r12 */
+    b1(0x41); b1(0x55);                      /* push r13 */
+    b1(0x41); b1(0x56);                      /* push r14 */
+    b1(0x41); b1(0x57);                      /* push r15 */
+    b1(0x48); b1(0x83); b1(0xec); b1(0x08);  /* sub rsp, 8 */
+    b1(0x48); b1(0x89); b1(0xfb);            /* mov rbx, rdi */
+    b1(0x49); b1(0x89); b1(0xf6);            /* mov r14, rsi */
+    movri(R12, 0);
+    movri(R13, 1);
+
+    tos = 0;
+    for (pc = 0; pc < len; pc++)
+    {
+        if (label[pc])
+            flush();
+        noff[pc] = blen;
+        ent[pc] = blen;
+        tosat[pc] = tos;
+        if (gen(&ins[pc], pc) < 0)
+            goto fail;
+    }
+
+    /* running off the end of the code */
+    flush();
+    bad(len);
+
+    /* a RET can go anywhere if the code stores its own return
+       address, the instructions that expect the top of the stack
+       in eax get an entry that loads it first */
+    for (pc = 0; pc < len; pc++)
+    {
+        if (!tosat[pc])
+            continue;
+        ent[pc] = blen;
+        load(RAX, R12);
+        jump(-1, pc);
+    }
+
+    for (f = fix; f < fix + nfix; f++)
+    {
+        i = noff[f->pc] - (f->off + 4);
+        memcpy(&buf[f->off], &i, 4);
+    }
+
+    if (jitmem)
+        munmap(jitmem, jitsize);
+    jitsize = blen;
+    jitmem = mmap(NULL, jitsize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jitmem == MAP_FAILED)
+        die("jit: mmap: %s", strerror(errno));
+    memcpy(jitmem, buf, blen);
+    if (mprotect(jitmem, jitsize, PROT_READ | PROT_EXEC) < 0)
+        die("jit: mprotect: %s", strerror(errno));
+
+    free(jittab);
+    jittab = emalloc(sizeof(jittab[0]) * (len + 1));
+    for (pc = 0; pc < len; pc++)
+        jittab[pc] = jitmem + ent[pc];
+
+    /* the entry point, the prologue falls into instruction 0 */
+    jittab[len] = jitmem + noff[len];
+
+    free(noff);
+    free(ent);
+    free(label);
+    free(tosat);
+    return 0;
+
+fail:
+    free(noff);
+    free(ent);
+    free(label);
+    free(tosat);
+    return -1;
+}
+
+/* run the compiled code on the stack */
+void jitexec(int *stk)
+{
+    void (*fn)(int *, void **);
+
+    memcpy(&fn, &jittab[jitlen], sizeof(fn));
+    fn(stk, jittab);
+}
+
+/* the trace jit, a path one time around a loop in the fused
+   code gets compiled with everything in memory, since the
+   depth of the stack at every instruction is known the stack
+   slots get addressed from where sp was at the top:
+
+   rbx  the stack
+   r12  &stk[sp] at the top of the loop
+   r13  where the times around it can still go get written back
+   r14  the display
+   r15  the times around it can still go
+
+   the code is verified so nothing gets masked, a exit returns
+   its index in eax */
+
+/* op reg, [base + idx*4 + disp], idx < 0 for none */
+static void mop(int op, int reg, int base, int idx, int disp)
+{
+    rex(0, reg, (idx < 0) ? 0 : idx, base);
+    b1(op);
+    if (idx < 0 && (base & 7) != RSP)
+        b1(0x80 | ((reg & 7) << 3) | (base & 7));
+    else
+    {
+        b1(0x84 | ((reg & 7) << 3));
+        b1((idx < 0) ? 0x20 | (base & 7) : 0x80 | ((idx & 7) << 3) | (base & 7));
+    }
+    b4(disp);
+}
+
+/* reg = the slot d above the top of the loop */
+static void tload(int reg, int d)
+{
+    mop(0x8b, reg, R12, -1, 4 * d);
+}
+
+static void tstore(int d, int reg)
+{
+    mop(0x89, reg, R12, -1, 4 * d);
+}
+
+/* reg = variable m of the frame of level l, edx gets used for the frame */
+static void tvar(int reg, int l, int m)
+{
+    mop(0x8b, RDX, R14, -1, 4 * l);
+    mop(0x8b, reg, RBX, RDX, 4 * m);
+}
+
+static void tsetvar(int l, int m, int reg)
+{
+    mop(0x8b, RDX, R14, -1, 4 * l);
+    mop(0x89, reg, RBX, RDX, 4 * m);
+}
+
+/* eax = eax op ecx for the arithmetic ops */
+static void tarith(int op)
+{
+    switch (op)
+    {
+        case XADD: b1(0x01); b1(0xc8); break;
+        case XSUB: b1(0x29); b1(0xc8); break;
+        case XMUL: b1(0x0f); b1(0xaf); b1(0xc1); break;
+    }
+}
+
+/* eax = eax cc ecx, or the immediate v when k is set */
+static void tcmp(int cc, int k, int v)
+{
+    if (k)
+        alu(7, RAX, v);
+    else
+    {
+        b1(0x39); b1(0xc8);           /* cmp eax, ecx */
+    }
+    b1(0x0f); b1(0x90 | cc); b1(0xc0); /* setcc al */
+    b1(0x0f); b1(0xb6); b1(0xc0);     /* movzx eax, al */
+}
+
+static void trwrite(VM *vm, int v)
+{
+    vm->nwrite++;
+    fprintf(vm->out, "Value on top of the stack: %d\n", v);
+}
+
+static Exit *texit;
+static int ntexit;
+
+/* a exit to pc with sp at d after ran instructions, taken
+   when cc holds, always when it is < 0 */
+static void texitto(int cc, int pc, int d, int ran)
+{
+    texit[ntexit].pc = pc;
+    texit[ntexit].sp = d;
+    texit[ntexit].ran = ran;
+    jump(cc, ntexit++);
+}
+
+/* the branch at i of the path, cc is the condition the code
+   jumps to target on */
+static void tbranch(int cc, int pc, int target, int next, int d, int i)
+{
+    if (target == pc + 1)
+        return;
+    if (next == target)
+        texitto(cc ^ 1, pc + 1, d, i + 1);
+    else
+        texitto(cc, target, d, i + 1);
+}
+
+/* compile the n instructions at the pcs in path, path[n]
+   is the top again, returns NULL when it can't */
+Trace *tracegen(VM *vm, int *path, int n)
+{
+    static const unsigned char rel[] =
+    {
+        [0] = CE, [1] = CNE, [2] = CL, [3] = CLE, [4] = CG, [5] = CGE
+    };
+
+    Prog *p;
+    Xins *ir;
+    Sup *s;
+    Trace *t;
+    Fix *f;
+    unsigned long long v;
+    int *stub, loop, pc, d, i, k;
+
+    p = vm->prog;
+    blen = 0;
+    nfix = 0;
+    texit = emalloc(sizeof(texit[0]) * (2 * n + 1));
+    ntexit = 0;
+
+    /* epilogue, the exits jump back here with their index in eax */
+    b1(0x4d); b1(0x89); b1(0x7d); b1(0x00);  /* mov [r13], r15 */
+    b1(0x48); b1(0x83); b1(0xc4); b1(0x08);  /* add rsp, 8 */
+    b1(0x41); b1(0x5f);                      /* pop r15 */
+    b1(0x41); b1(0x5e);                      /* pop r14 */
+    b1(0x41); b1(0x5d);                      /* pop r13 */
+    b1(0x41); b1(0x5c);                      /* pop r12 */
+    b1(0x5d);                                /* pop rbp */
+    b1(0x5b);                                /* pop rbx */
+    b1(0xc3);                                /* ret */
+
+    /* exit 0 is running out of times around, at the top */
+    texit[ntexit].pc = path[0];
+    texit[ntexit].sp = 0;
+    texit[ntexit++].ran = 0;
+
+    /* fn(stk, &stk[sp], display, &times) */
+    k = blen;
+    b1(0x53);                                /* push rbx */
+    b1(0x55);                                /* push rbp */
+    b1(0x41); b1(0x54);                      /* push r12 */
+    b1(0x41); b1(0x55);                      /* push r13 */
+    b1(0x41); b1(0x56);                      /* push r14 */
+    b1(0x41); b1(0x57);                      /* push r15 */
+    b1(0x48); b1(0x83); b1(0xec); b1(0x08);  /* sub rsp, 8 */
+    b1(0x48); b1(0x89); b1(0xfb);            /* mov rbx, rdi */
+    b1(0x49); b1(0x89); b1(0xf4);            /* mov r12, rsi */
+    b1(0x49); b1(0x89); b1(0xd6);            /* mov r14, rdx */
+    b1(0x49); b1(0x89); b1(0xcd);            /* mov r13, rcx */
+    b1(0x4d); b1(0x8b); b1(0x7d); b1(0x00);  /* mov r15, [r13] */
+
+    loop = blen;
+    d = 0;
+    for (i = 0; i < n; i++)
+    {
+        pc = path[i];
+        ir = &p->xins[pc];
+        switch (ir->op)
+        {
+            case XLIT: case XLIT0: case XLIT1:
+                d++;
+                mop(0xc7, 0, R12, -1, 4 * d);
+                b4(ir->m);
+                break;
+
+            case XLODD: case XLOD0:
+                tvar(RAX, ir->l, ir->m);
+                tstore(++d, RAX);
+                break;
+
+            case XSTOD: case XSTO0:
+                tload(RAX, d--);
+                tsetvar(ir->l, ir->m, RAX);
+                break;
+
+            case XNEG:
+                tload(RAX, d);
+                b1(0xf7); b1(0xd8);
+                tstore(d, RAX);
+                break;
+
+            case XODD:
+                tload(RAX, d);
+                movri(RCX, 2);
+                b1(0x99);
+                b1(0xf7); b1(0xf9);
+                tstore(d, RDX);
+                break;
+
+            case XADD: case XSUB: case XMUL:
+                tload(RCX, d--);
+                tload(RAX, d);
+                tarith(ir->op);
+                tstore(d, RAX);
+                break;
+
+            /* dividing by 0 goes back to the loop to die there */
+            case XDIV: case XMOD:
+                tload(RCX, d);
+                test(RCX);
+                texitto(CE, pc, d, i);
+                tload(RAX, --d);
+                b1(0x99);
+                b1(0xf7); b1(0xf9);
+                tstore(d, (ir->op == XDIV) ? RAX : RDX);
+                break;
+
+            case XEQL: case XNEQ: case XLSS: case XLEQ: case XGTR: case XGEQ:
+                tload(RCX, d--);
+                tload(RAX, d);
+                tcmp(rel[ir->op - XEQL], 0, 0);
+                tstore(d, RAX);
+                break;
+
+            case XADDK: case XSUBK: case XMULK:
+                tload(RAX, d);
+                if (ir->op == XMULK)
+                {
+                    b1(0x69); b1(0xc0); b4(ir->m);   /* imul eax, eax, m */
+                }
+                else
+                    alu((ir->op == XADDK) ? 0 : 5, RAX, ir->m);
+                tstore(d, RAX);
+                break;
+
+            case XDIVK: case XMODK:
+                if (ir->m == 0)
+                {
+                    texitto(-1, pc, d, i);
+                    break;
+                }
+                tload(RAX, d);
+                movri(RCX, ir->m);
+                b1(0x99);
+                b1(0xf7); b1(0xf9);
+                tstore(d, (ir->op == XDIVK) ? RAX : RDX);
+                break;
+
+            case XEQLK: case XNEQK: case XLSSK: case XLEQK: case XGTRK: case XGEQK:
+                tload(RAX, d);
+                tcmp(rel[ir->op - XEQLK], 1, ir->m);
+                tstore(d, RAX);
+                break;
+
+            case XADDVV: case XSUBVV: case XMULVV:
+                s = &p->sup[ir->m];
+                tvar(RAX, s->l1, s->m1);
+                tvar(RCX, s->l2, s->m2);
+                tarith(XADD + (ir->op - XADDVV));
+                tsetvar(s->l3, s->m3, RAX);
+                break;
+
+            case XADDVK: case XSUBVK:
+                s = &p->sup[ir->m];
+                tvar(RAX, s->l1, s->m1);
+                alu((ir->op == XADDVK) ? 0 : 5, RAX, s->m2);
+                tsetvar(s->l3, s->m3, RAX);
+                break;
+
+            case XJMP:
+                break;
+
+            case XJPC:
+                tload(RAX, d--);
+                test(RAX);
+                tbranch(CE, pc, ir->m, path[i + 1], d, i);
+                break;
+
+            case XJEQL: case XJNEQ: case XJLSS: case XJLEQ: case XJGTR: case XJGEQ:
+                tload(RCX, d--);
+                tload(RAX, d--);
+                b1(0x39); b1(0xc8);               /* cmp eax, ecx */
+                tbranch(rel[ir->op - XJEQL] ^ 1, pc, ir->m, path[i + 1], d, i);
+                break;
+
+            case XJEQLK: case XJNEQK: case XJLSSK: case XJLEQK: case XJGTRK: case XJGEQK:
+                tload(RAX, d--);
+                alu(7, RAX, ir->l);
+                tbranch(rel[ir->op - XJEQLK] ^ 1, pc, ir->m, path[i + 1], d, i);
+                break;
+
+            case XJODD:
+                tload(RAX, d--);
+                b1(0xa9); b4(1);                  /* test eax, 1 */
+                tbranch(CE, pc, ir->m, path[i + 1], d, i);
+                break;
+
+            case XSIO1:
+                v = 0;
+                memcpy(&v, &vm, sizeof(vm));
+                b1(0x48); b1(0xbf); b8(v);        /* mov rdi, vm */
+                tload(RSI, d--);
+                call((Fn)trwrite);
+                break;
+
+            default:
+                goto fail;
+        }
+    }
+    if (d != 0)
+        goto fail;
+
+    /* around again, or out when it can't go any more times */
+    b1(0x49); b1(0xff); b1(0xcf);                 /* dec r15 */
+    jump(CE, 0);
+    b1(0xe9); b4(loop - (blen + 4));
+
+    stub = emalloc(sizeof(stub[0]) * ntexit);
+    for (i = 0; i < ntexit; i++)
+    {
+        stub[i] = blen;
+        movri(RAX, i);
+        exit_();
+    }
+    for (f = fix; f < fix + nfix; f++)
+    {
+        i = stub[f->pc] - (f->off + 4);
+        memcpy(&buf[f->off], &i, 4);
+    }
+    free(stub);
+
+    t = emalloc(sizeof(*t));
+    t->size = blen;
+    t->mem = mmap(NULL, t->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (t->mem == MAP_FAILED)
+        die("jit: mmap: %s", strerror(errno));
+    memcpy(t->mem, buf, blen);
+    if (mprotect(t->mem, t->size, PROT_READ | PROT_EXEC) < 0)
+        die("jit: mprotect: %s", strerror(errno));
+    t->fn = (char*)t->mem + k;
+    t->len = n;
+    t->exit = texit;
+    return t;
+
+fail:
+    free(texit);
+    return NULL;
+}
+
+void tracefree(Trace *t)
+{
+    munmap(t->mem, t->size);
+    free(t->exit);
+    free(t);
+}
+
+#else
+
+int jitcompile(Ins *ins, int len, int top)
+{
+    (void)ins;
+    (void)len;
+    (void)top;
+    return -1;
+}
+
+void jitexec(int *stk)
+{
+    (void)stk;
+}
+
+Trace *tracegen(VM *vm, int *path, int n)
+{
+    (void)vm;
+    (void)path;
+    (void)n;
+    return NULL;
+}
+
+void tracefree(Trace *t)
+{
+    (void)t;
+}
+
+#endif
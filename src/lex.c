@@ -479,7 +479,7 @@ int tokenize(char *f)
         list = emalloc(sizeof(List));
 
     for (lp = list; lp; lp = lp->next)
-        lp->cap = 0;
+        lp->cap = lp->len = 0;
     lp = list;
     
     for (;;)
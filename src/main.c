@@ -4,22 +4,69 @@
 /* input and output filenames to be during runtime */
 static char *input;
 static char *codeoutput = "output.txt";
+static char *objoutput = "output.bin";
+static char *coutput = "output.c";
 
 /* flags */
 static int vmfile;
 static int dumpcode;
+static int dumpobj;
+static int dumpc;
+static int batchmode;
 
 int lexonly;
 int verbose;
+int engine;
+int showfuse;
+int stacklimit = MAX_STACK_HEIGHT;
+long long quota;
+int timeout;
+long long ckpt;
+char *snapfile = "output.snap";
+char *tracefile;
+int debugging;
+char *profile;
+char *heatmap;
+int telemetry;
+int resume;
 
 static void usage(void)
 {
-    fprintf(stderr, "usage: [-dhlp] input [output]\n");
+    fprintf(stderr, "usage: [-abdefhijlnoprstuvx] [-c instructions] [-g trace] [-k snapshot] [-m words] [-q instructions] [-w ms] input [output]\n");
+    fprintf(stderr, "       [-flags] --batch jobs [threads]\n");
+    fprintf(stderr, "       --decode trace\n");
+    fprintf(stderr, "       --profile stacks [-flags] input\n");
+    fprintf(stderr, "       --sample heatmap [-flags] input\n");
+    fprintf(stderr, "       --top pid [ms]\n");
+    fprintf(stderr, "\t--batch: run every program and input file in jobs, one job a line, a slice at a time over a few threads\n");
+    fprintf(stderr, "\t--decode: print the trace -g wrote the way -v prints the run\n");
+    fprintf(stderr, "\t--sample: sample the pc every ms of cpu and write the source with the samples of every line to heatmap\n");
+    fprintf(stderr, "\t--top: print the counters the pl0 -o running as pid publishes every ms, default is every second, until it ends\n");
+    fprintf(stderr, "\t--profile: count what every instruction, op, procedure and loop ran and print it sorted when the program ends, the call stacks go to stacks for flamegraph.pl\n");
+    fprintf(stderr, "\t-a: run the code with the links and return pcs of the frames on a control stack of their own, away from the locals\n");
+    fprintf(stderr, "\t-b: write the code as a object file -p can map in to the [output] file, default file used is %s\n", objoutput);
+    fprintf(stderr, "\t-c: write a snapshot of the vm to the snapshot file every this many instructions\n");
     fprintf(stderr, "\t-d: dump the generated code to the [output] file, default file used is %s\n", codeoutput);
+    fprintf(stderr, "\t-e: write the code as a C program to build with cc -O2 -pthread to the [output] file, default file used is %s\n", coutput);
+    fprintf(stderr, "\t-f: print how many instruction sequences got fused into superinstructions\n");
+    fprintf(stderr, "\t-g: write a binary trace of every instruction the vm runs to the trace file, for --decode\n");
     fprintf(stderr, "\t-h: print this usage\n");
+    fprintf(stderr, "\t-i: debug the program, stop it at breakpoints and step through it with commands read from stdin, h lists them\n");
+    fprintf(stderr, "\t-j: compile the code to machine code and run that (x86-64 only)\n");
+    fprintf(stderr, "\t-k: the snapshot file -c writes and -u reads, default file used is %s\n", snapfile);
     fprintf(stderr, "\t-l: only lex, don't parse or execute code\n");
+    fprintf(stderr, "\t-m: let the vm stack grow up to this many words, default is %d\n", MAX_STACK_HEIGHT);
+    fprintf(stderr, "\t-n: run the code as a chain of C functions with the operands bound to them, one per instruction\n");
+    fprintf(stderr, "\t-o: publish the instructions run, pc, stack and call depth and reads and writes in shared memory for --top (stack vm only)\n");
     fprintf(stderr, "\t-p: execute input as if it was a instruction file and not pl0 source\n");
+    fprintf(stderr, "\t-q: stop the program with a error after this many instructions (stack vm only)\n");
+    fprintf(stderr, "\t-r: translate the code to register code and run that instead of the stack code\n");
+    fprintf(stderr, "\t-s: run the vm with the portable switch loop instead of the threaded one\n");
+    fprintf(stderr, "\t-t: run the threaded loop with the top of the stack kept out of memory\n");
+    fprintf(stderr, "\t-u: go on from the snapshot in the snapshot file instead of starting the program, with --batch every job of its program does\n");
     fprintf(stderr, "\t-v: be verbose (output every stage of the compilation while running the program)\n");
+    fprintf(stderr, "\t-w: stop the program with a error after this many ms (stack vm only)\n");
+    fprintf(stderr, "\t-x: compile the loops the program spends its time in to machine code while it runs (x86-64 only)\n");
     exit(1);
 }
 
@@ -33,6 +80,37 @@ int main(int argc, char *argv[])
         if (argv[1][0] != '-')
             break;
 
+        /* the long options, the rest of the arguments are theirs */
+        if (strcmp(argv[1], "--batch") == 0)
+        {
+            batchmode = 1;
+            argc--;
+            argv++;
+            break;
+        }
+        if (strcmp(argv[1], "--decode") == 0)
+            return ringdecode(argv[2]) ? 1 : 0;
+        if (strcmp(argv[1], "--top") == 0)
+            return teletop(atoi(argv[2]), (argc > 3) ? atoi(argv[3]) : 1000) ? 1 : 0;
+        if (strcmp(argv[1], "--profile") == 0)
+        {
+            if (argc < 4)
+                usage();
+            profile = argv[2];
+            argc -= 2;
+            argv += 2;
+            continue;
+        }
+        if (strcmp(argv[1], "--sample") == 0)
+        {
+            if (argc < 4)
+                usage();
+            heatmap = argv[2];
+            argc -= 2;
+            argv += 2;
+            continue;
+        }
+
         for (i = 1; argv[1][i] != '\0'; i++)
         {
             switch (argv[1][i])
@@ -41,6 +119,10 @@ int main(int argc, char *argv[])
                     vmfile = 1;
                     break;
 
+                case 'j':
+                    engine = EJIT;
+                    break;
+
                 case 'l':
                     lexonly = 1;
                     verbose = 1;
@@ -49,11 +131,122 @@ int main(int argc, char *argv[])
                 case 'd':
                     dumpcode = 1;
                     break;
+
+                case 'b':
+                    dumpobj = 1;
+                    break;
+
+                case 'e':
+                    dumpc = 1;
+                    break;
                 
+                case 'r':
+                    engine = EREG;
+                    break;
+
+                case 's':
+                    engine = ESWITCH;
+                    break;
+
+                case 't':
+                    engine = ETOS;
+                    break;
+
+                case 'x':
+                    engine = ETRACE;
+                    break;
+
+                case 'n':
+                    engine = ECLOSURE;
+                    break;
+
+                case 'a':
+                    engine = ESPLIT;
+                    break;
+
                 case 'v':
                     verbose = 1;
                     break;
 
+                case 'f':
+                    showfuse = 1;
+                    break;
+
+                case 'i':
+                    debugging = 1;
+                    break;
+
+                case 'o':
+                    telemetry = 1;
+                    break;
+
+                case 'u':
+                    resume = 1;
+                    break;
+
+                /* takes the next argument, move the flags over it */
+                case 'm':
+                    if (argc < 4)
+                        usage();
+                    stacklimit = atoi(argv[2]);
+                    if (stacklimit < 64 || stacklimit > MAX_STACK_LIMIT)
+                        die("stack limit has to be between 64 and %d words", MAX_STACK_LIMIT);
+                    argv[2] = argv[1];
+                    argc--;
+                    argv++;
+                    break;
+
+                case 'c':
+                    if (argc < 4)
+                        usage();
+                    ckpt = atoll(argv[2]);
+                    if (ckpt <= 0)
+                        die("the checkpoint interval has to be more than 0 instructions");
+                    argv[2] = argv[1];
+                    argc--;
+                    argv++;
+                    break;
+
+                case 'g':
+                    if (argc < 4)
+                        usage();
+                    tracefile = argv[2];
+                    argv[2] = argv[1];
+                    argc--;
+                    argv++;
+                    break;
+
+                case 'k':
+                    if (argc < 4)
+                        usage();
+                    snapfile = argv[2];
+                    argv[2] = argv[1];
+                    argc--;
+                    argv++;
+                    break;
+
+                case 'q':
+                    if (argc < 4)
+                        usage();
+                    quota = atoll(argv[2]);
+                    if (quota <= 0)
+                        die("the quota has to be more than 0 instructions");
+                    argv[2] = argv[1];
+                    argc--;
+                    argv++;
+                    break;
+
+                case 'w':
+                    if (argc < 4)
+                        usage();
+                    timeout = atoi(argv[2]);
+                    if (timeout <= 0)
+                        die("the timeout has to be more than 0 ms");
+                    argv[2] = argv[1];
+                    argc--;
+                    argv++;
+                    break;
+
                 case 'h':
                 default:
                     usage();
@@ -68,6 +261,16 @@ int main(int argc, char *argv[])
     if (argc < 2)
         usage();
 
+    if (batchmode && (profile || heatmap))
+        die("--profile and --sample can't profile a batch");
+
+    /* the sampler reads the pc the loops of the stack vm keep in
+       the machine, the other engines don't keep it there */
+    if (heatmap && engine != ESWITCH && engine != ETOS)
+        engine = ETHREAD;
+    if (batchmode)
+        return batch(argv[1], (argc >= 3) ? atoi(argv[2]) : 0, vmfile) ? 1 : 0;
+
     input = argv[1];
 
     /* load instruction file or source file */
@@ -77,11 +280,24 @@ int main(int argc, char *argv[])
         compile(input);
 
     /* write code to output if needed */
+    /* with more than one of -d, -b and -e the output goes to
+       the first of them and the others keep their default names */
     if (argc >= 3)
-        codeoutput = argv[2];
+    {
+        if (dumpcode || (!dumpobj && !dumpc))
+            codeoutput = argv[2];
+        else if (dumpobj)
+            objoutput = argv[2];
+        else
+            coutput = argv[2];
+    }
 
     if (dumpcode)
         writeinsfile(codeoutput);
+    if (dumpobj)
+        writeobjfile(objoutput);
+    if (dumpc)
+        writecfile(coutput);
 
     /* execute the vm */
     execute();
@@ -0,0 +1,182 @@
+#define _DEFAULT_SOURCE
+#include "dat.h"
+#include "fns.h"
+
+#ifdef __unix__
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+/* the binary object format, the packed code as it is in memory
+   so a file can get mapped in and run without parsing it:
+
+   magic    "PL0B"
+   version  OBJVERSION
+   order    0x01020304 in the byte order of the writer
+   ncode    instructions in the code
+   npool    instructions in the constant pool
+   sum      fnv-1a of everything after the header
+
+   then ncode Code words and npool Ins, all 4 byte ints,
+   a file from a machine with the other byte order
+   gets rejected instead of swapped
+*/
+
+enum
+{
+    OBJVERSION = 1,
+    OBJORDER   = 0x01020304
+};
+
+typedef struct
+{
+    char     magic[4];
+    uint32_t version;
+    uint32_t order;
+    uint32_t ncode;
+    uint32_t npool;
+    uint32_t sum;
+} Obj;
+
+/* fnv-1a, the snapshots use it for the code too */
+uint32_t fnv(uint32_t h, void *buf, size_t n)
+{
+    unsigned char *p;
+
+    for (p = buf; n > 0; n--)
+    {
+        h ^= *p++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* is f a object file and not a text one */
+int isobj(char *f)
+{
+    FILE *fp;
+    char magic[4];
+    int r;
+
+    fp = fopen(f, "rb");
+    if (!fp)
+        die("%s: %s", f, strerror(errno));
+    r = fread(magic, 1, 4, fp) == 4 && memcmp(magic, "PL0B", 4) == 0;
+    fclose(fp);
+    return r;
+}
+
+void writeobj(char *f, Code *code, int len)
+{
+    FILE *fp;
+    Obj h;
+    Ins *pool;
+    int npool;
+
+    pool = poolget(&npool);
+
+    memcpy(h.magic, "PL0B", 4);
+    h.version = OBJVERSION;
+    h.order = OBJORDER;
+    h.ncode = len;
+    h.npool = npool;
+    h.sum = fnv(2166136261u, code, sizeof(code[0]) * len);
+    h.sum = fnv(h.sum, pool, sizeof(pool[0]) * npool);
+
+    fp = fopen(f, "wb");
+    if (!fp)
+    {
+        fprintf(stderr, "%s: %s\n", f, strerror(errno));
+        return;
+    }
+
+    if (fwrite(&h, sizeof(h), 1, fp) != 1 ||
+        fwrite(code, sizeof(code[0]), len, fp) != (size_t)len ||
+        fwrite(pool, sizeof(pool[0]), npool, fp) != (size_t)npool)
+        fprintf(stderr, "%s: %s\n", f, strerror(errno));
+
+    fclose(fp);
+}
+
+/* map a object file in, returns the code in it and sets
+   the constant pool to the one in it */
+Code *mapobj(char *f, int *len)
+{
+    static void *map;
+    static size_t maplen;
+    Obj *h;
+    Code *code;
+    Ins *pool;
+    size_t size;
+    uint32_t sum, i;
+
+#ifdef __unix__
+    struct stat st;
+    int fd;
+
+    if (map)
+        munmap(map, maplen);
+
+    fd = open(f, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0)
+        die("%s: %s", f, strerror(errno));
+    size = st.st_size;
+    if (size < sizeof(*h))
+        die("%s: truncated object file", f);
+
+    map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+        die("%s: mmap: %s", f, strerror(errno));
+    maplen = size;
+    close(fd);
+#else
+    FILE *fp;
+
+    free(map);
+    fp = fopen(f, "rb");
+    if (!fp)
+        die("%s: %s", f, strerror(errno));
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    rewind(fp);
+    if (size < sizeof(*h))
+        die("%s: truncated object file", f);
+    map = emalloc(size);
+    if (fread(map, 1, size, fp) != size)
+        die("%s: %s", f, strerror(errno));
+    maplen = size;
+    fclose(fp);
+#endif
+
+    h = map;
+    if (memcmp(h->magic, "PL0B", 4) != 0)
+        die("%s: not a object file", f);
+    if (h->order != OBJORDER)
+        die("%s: object file has the wrong byte order", f);
+    if (h->version != OBJVERSION)
+        die("%s: object file version %u, expected %d", f, h->version, OBJVERSION);
+    if (h->ncode >= MAX_CODE_LENGTH || h->npool > MAX_CODE_LENGTH)
+        die("%s: max code length exceeded", f);
+    if (size != sizeof(*h) + sizeof(Code) * h->ncode + sizeof(Ins) * h->npool)
+        die("%s: object file has the wrong size", f);
+
+    code = (Code*)(h + 1);
+    pool = (Ins*)(code + h->ncode);
+    sum = fnv(2166136261u, code, sizeof(code[0]) * h->ncode);
+    sum = fnv(sum, pool, sizeof(pool[0]) * h->npool);
+    if (sum != h->sum)
+        die("%s: object file checksum mismatch", f);
+
+    /* unpack trusts the pool indices */
+    for (i = 0; i < h->ncode; i++)
+    {
+        if (ispooled(code[i]) && code[i] >> 8 >= h->npool)
+            die("%s: bad constant pool index at %u", f, i);
+    }
+
+    poolset(pool, h->npool);
+    *len = h->ncode;
+    return code;
+}
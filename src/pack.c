@@ -0,0 +1,96 @@
+#include "dat.h"
+#include "fns.h"
+
+/* the packed instruction encoding, 4 bytes instead of 12:
+
+   bits 0-3   op
+   bits 4-7   L
+   bits 8-31  M, signed
+
+   the parser never makes anything that doesn't fit, but a
+   instruction file can, those get op PESC and M is the index
+   of the whole instruction in the constant pool, a zero word
+   still unpacks to a zero instruction
+*/
+
+enum
+{
+    PESC  = 15,
+    MBITS = 24
+};
+
+static Ins *pool;
+static int  npool;
+static int  pcap;
+static int  mapped;
+
+static int fits(int v, int bits)
+{
+    return v >= -(1 << (bits - 1)) && v < (1 << (bits - 1));
+}
+
+/* forget the pool, when code gets loaded over what was there */
+void poolreset(void)
+{
+    if (mapped)
+    {
+        pool = NULL;
+        pcap = 0;
+        mapped = 0;
+    }
+    npool = 0;
+}
+
+/* use a pool that is somewhere else, like in a mapped object
+   file, it is read only so it doesn't get grown */
+void poolset(Ins *p, int n)
+{
+    if (!mapped)
+        free(pool);
+    pool = p;
+    npool = n;
+    pcap = 0;
+    mapped = 1;
+}
+
+Ins *poolget(int *n)
+{
+    *n = npool;
+    return pool;
+}
+
+int ispooled(Code c)
+{
+    return (c & 15) == PESC;
+}
+
+Code pack(Ins *p)
+{
+    if (p->op > 0 && p->op < PESC && p->l >= 0 && p->l < 16 && fits(p->m, MBITS))
+        return (Code)p->op | (Code)p->l << 4 | (Code)p->m << 8;
+
+    if (npool >= pcap)
+    {
+        pcap = max(pcap * 2, 64);
+        pool = realloc(pool, pcap * sizeof(pool[0]));
+        if (!pool)
+            die("oom trying to allocate the constant pool");
+    }
+    pool[npool] = *p;
+    return PESC | (Code)npool++ << 8;
+}
+
+void unpack(Code c, Ins *p)
+{
+    if ((c & 15) == PESC)
+    {
+        *p = pool[c >> 8];
+        return;
+    }
+
+    p->op = c & 15;
+    p->l = (c >> 4) & 15;
+    p->m = (int)(c >> 8);
+    if (p->m >= 1 << (MBITS - 1))
+        p->m -= 1 << MBITS;
+}
@@ -62,6 +62,26 @@ static Symtab stab[MAX_LEXI_LEVEL+1];
 static int    npargs[MAX_LEXI_LEVEL+1];
 static int    lexi;
 
+/* where the procedure being parsed is in the symbol map */
+static int    curproc;
+
+/* the calls made in the body being compiled, where their
+   arguments start, where the CAL is and how many arguments,
+   the ones that turn out to be the last thing before the RET
+   become tail calls */
+typedef struct Tail Tail;
+
+struct Tail
+{
+    int start;
+    int at;
+    int narg;
+};
+
+static Tail   *tails;
+static int    ntails;
+static int    tailcap;
+
 /* prints out a parser error, if it is greater
    than max parser error, quit */
 static void parerror(char *fmt, ...)
@@ -159,6 +179,7 @@ static Sym *addsym(Sym *s)
 
     sl = &t->sym[t->len++];
     *sl = *s;
+    mapsym(sl, curproc);
 
     return sl;
 }
@@ -320,7 +341,7 @@ static void condition(void)
 static void gcallproc(void)
 {
     Sym *s;
-    int n;
+    int n, start;
 
     token();
     expect(identsym, 14);
@@ -344,6 +365,7 @@ static void gcallproc(void)
     /* handle expressions in argument passing */
     token();
     n = 0;
+    start = codepos;
     if (tok != rparentsym)
     {
         for (;;)
@@ -373,11 +395,60 @@ static void gcallproc(void)
     if (s->addr < 0)
         pushcall(s);
 
+    if (ntails >= tailcap)
+    {
+        tailcap = max(tailcap * 2, 64);
+        tails = realloc(tails, sizeof(tails[0]) * tailcap);
+        if (!tails)
+            die("oom trying to grow the tail calls");
+    }
+    tails[ntails].start = start;
+    tails[ntails].at = codepos;
+    tails[ntails].narg = n;
+    ntails++;
     emit(OCAL, lexi - s->level, s->addr);
 
     token();
 }
 
+/* is the code from pc on nothing but jumps to the RET at end */
+static int attail(int pc, int end)
+{
+    Ins i;
+    int n;
+
+    for (n = 0; n < 16 && pc < end; n++)
+    {
+        unpack(code[pc], &i);
+        if (i.op != OJMP)
+            return 0;
+        pc = i.m;
+    }
+    return pc == end;
+}
+
+/* turn the calls in the body that go straight to its RET into
+   tail calls, only calls to a procedure at the same level as
+   this one can reuse the frame, the static link stays the same,
+   and the arguments have to fit in it */
+static void tailcalls(int first, int size)
+{
+    Tail *t;
+    Ins i;
+    int k;
+
+    for (k = first; k < ntails; k++)
+    {
+        t = &tails[k];
+        unpack(code[t->at], &i);
+        if (i.l != 1 || FRAME + t->narg > size)
+            continue;
+        if (attail(t->at + 1, codepos))
+            tailcall(t->start, t->at);
+    }
+    ntails = first;
+}
+
 static void statement(void)
 {
     Token *t1, *t2;
@@ -452,25 +523,22 @@ static void statement(void)
             }
         }
 
-        /* emit a jmp so if the condition goes through, it will
-           skip the else statement */
+        /* else, emit a jmp so if the condition goes through, it
+           will skip the else statement, and fix the jpc so that it
+           can skip the if code correctly */
         if (tok == elsesym)
         {
             a2 = codepos;
             emit(OJMP, 0, 0);
-        }
+            patch(a1, codepos);
 
-        /* fix the jpc so that it can skip the if code correctly */
-        code[a1].m = codepos;
-
-        /* else */
-        if (tok == elsesym)
-        {
             token();
             statement();
 
-            code[a2].m = codepos;
+            patch(a2, codepos);
         }
+        else
+            patch(a1, codepos);
     }
     else if (tok == callsym)
     {
@@ -492,7 +560,7 @@ static void statement(void)
 
         /* jump back to a1 then on next line we have a jpc */
         emit(OJMP, 0, a1);
-        code[a2].m = codepos;
+        patch(a2, codepos);
     }
     else if (tok == readsym)
     {
@@ -528,7 +596,7 @@ static void statement(void)
 static void block(void)
 {
     Sym s, *sl;
-    int l, n, t;
+    int l, n, t, p;
 
     n = 0;
 
@@ -606,6 +674,8 @@ static void block(void)
         sl = addsym(&s);
         if (!sl)
             return;
+        p = curproc;
+        curproc = ndsym - 1;
 
         /* push procedure to stack because we need to
            fix the address of it when we have enough info
@@ -701,18 +771,20 @@ static void block(void)
         expect(semicolonsym, 5);
         token();
         block();
+        curproc = p;
 
         expect(semicolonsym, 5);
         token();
     }
 
     /* make the jmp address correct now that we know the location */
-    code[l].m = codepos;
+    patch(l, codepos);
 
     /* give the procedure the right M address now that we have it
        (if there is any procedures)
      */
     popproc();
+    dsym[curproc].start = dsym[curproc].sym.addr = codepos;
 
     /* now make the procedure address in cal opcodes correct */
 
@@ -721,10 +793,16 @@ static void block(void)
        jmp can go to the right place afterwards
     */
     emit(OINC, 0, FRAME + npargs[lexi] + n);
+    t = ntails;
     statement();
+    if (lexi > 0)
+        tailcalls(t, FRAME + npargs[lexi] + n);
+    else
+        ntails = t;
 
     /* all the code in statement is done, so return */
     emit(OOPR, 0, ORET);
+    dsym[curproc].end = codepos;
 
     if (lexi-- < 0)
     {
@@ -743,11 +821,24 @@ static void program(void)
 /* starts parsing */
 int parse(void)
 {
+    Sym s;
+    int i;
+
     nerr = 0;
     lexi = 0;
 
-    memset(stab, 0, sizeof(stab));
+    /* the tables are only looked at up to their length */
+    for (i = 0; i < nelem(stab); i++)
+        stab[i].len = 0;
     memset(npargs, 0, sizeof(npargs));
+    ntails = 0;
+
+    /* the main program is a procedure of the map too */
+    s = S;
+    s.type = symproc;
+    s.level = -1;
+    snprintf(s.name, WBUF, "main");
+    curproc = mapsym(&s, -1);
 
     program();
     if (nerr)
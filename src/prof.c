@@ -0,0 +1,407 @@
+#include "dat.h"
+#include "fns.h"
+
+/* the profiler, --profile, it counts every instruction the
+   traced loop runs by its pc, and from that by its op, keeps a
+   stack of the calls the program is in to give every procedure
+   the instructions and wall time of its calls, inclusive of the
+   procedures it calls and exclusive of them, and counts the
+   backward jumps taken, the loops
+
+   the counts are kept for every path of calls the program went
+   down, in a tree with a node for every procedure called from a
+   path, the stacks file gets a line for each of them, the names
+   down the path and the instructions run in it without going
+   further, what flamegraph.pl and the tools like it read
+
+   a procedure is the pc its CAL goes to, named from the symbol
+   map, a recursive one only gets what its outermost call ran
+   inclusive so nothing gets counted twice */
+
+typedef struct Node Node;
+typedef struct Proc Proc;
+typedef struct Frame Frame;
+
+/* a procedure called down a path, what got run in it exclusive */
+struct Node
+{
+    int proc;
+    int parent;
+    int child;
+    int next;
+    long long n;
+    double ms;
+};
+
+struct Proc
+{
+    long long calls;
+    long long incl;
+    long long excl;
+    double inclms;
+    double exclms;
+    int active;
+};
+
+/* a call the program is in, its node and the count and time
+   when it was made */
+struct Frame
+{
+    int node;
+    long long n;
+    double ms;
+};
+
+enum
+{
+    NTOP = 10
+};
+
+static char *xname[NXOP] =
+{
+#define X(x) [x] = #x,
+    XOPS
+#undef X
+};
+
+static Prog *prog;
+static char *stacks;
+static unsigned char *dec;
+static long long *npc;
+static long long *nback;
+static Proc *proc;
+static int main0;
+
+static Node *node;
+static int nnode;
+static int nodecap;
+static Frame *frame;
+static int depth;
+static int framecap;
+static int cur;
+
+static long long total;
+static double start;
+static double last;
+
+/* the node of procedure p called from the path of node parent */
+static int child(int parent, int p)
+{
+    Node *c;
+    int i;
+
+    for (i = node[parent].child; i >= 0; i = node[i].next)
+    {
+        if (node[i].proc == p)
+            return i;
+    }
+
+    if (nnode >= nodecap)
+    {
+        nodecap *= 2;
+        node = realloc(node, sizeof(node[0]) * nodecap);
+        if (!node)
+            die("oom trying to grow the profile");
+    }
+
+    i = nnode++;
+    c = &node[i];
+    c->proc = p;
+    c->parent = parent;
+    c->child = -1;
+    c->next = node[parent].child;
+    c->n = 0;
+    c->ms = 0;
+    node[parent].child = i;
+    return i;
+}
+
+/* the time since the last call or return goes to the node */
+static void charge(void)
+{
+    double t;
+
+    t = clockms(0);
+    node[cur].ms += t - last;
+    last = t;
+}
+
+static void enter(int pc)
+{
+    Frame *f;
+    int p;
+
+    p = (pc >= 0 && pc < prog->inslen) ? pc : main0;
+    charge();
+    if (depth >= framecap)
+    {
+        framecap *= 2;
+        frame = realloc(frame, sizeof(frame[0]) * framecap);
+        if (!frame)
+            die("oom trying to grow the profile");
+    }
+
+    cur = child(cur, p);
+    f = &frame[depth++];
+    f->node = cur;
+    f->n = total;
+    f->ms = last;
+    proc[p].calls++;
+    proc[p].active++;
+}
+
+static void leave(void)
+{
+    Frame *f;
+    Proc *p;
+
+    if (depth == 0)
+        return;
+    charge();
+    f = &frame[--depth];
+    p = &proc[node[f->node].proc];
+    if (--p->active == 0)
+    {
+        p->incl += total - f->n;
+        p->inclms += last - f->ms;
+    }
+    if (depth > 0)
+        cur = frame[depth - 1].node;
+}
+
+/* start profiling the run of p, the stacks go to file f */
+void profopen(char *f, Prog *p)
+{
+    int i;
+
+    prog = p;
+    stacks = f;
+    main0 = p->inslen;
+    dec = emalloc(p->inslen + 1);
+    for (i = 0; i < p->inslen; i++)
+        dec[i] = decode(&p->wide[i]);
+    npc = emalloc(sizeof(npc[0]) * (p->inslen + 1));
+    nback = emalloc(sizeof(nback[0]) * (p->inslen + 1));
+    proc = emalloc(sizeof(proc[0]) * (main0 + 1));
+
+    nodecap = 64;
+    node = emalloc(sizeof(node[0]) * nodecap);
+    framecap = 64;
+    frame = emalloc(sizeof(frame[0]) * framecap);
+
+    /* the main program is the root, called once */
+    nnode = 1;
+    node[0].proc = main0;
+    node[0].parent = -1;
+    node[0].child = -1;
+    node[0].next = -1;
+    cur = 0;
+    depth = 1;
+    frame[0].node = 0;
+    frame[0].n = 0;
+    frame[0].ms = start = last = clockms(0);
+    proc[main0].calls = 1;
+    proc[main0].active = 1;
+    total = 0;
+    atexit(profclose);
+}
+
+/* the instruction vm just ran */
+void profput(VM *vm)
+{
+    int pc;
+
+    pc = vm->oldpc;
+    if (pc < 0 || pc >= prog->inslen)
+        return;
+
+    npc[pc]++;
+    node[cur].n++;
+    total++;
+    switch (dec[pc])
+    {
+        case XCAL:
+            enter(vm->pc);
+            break;
+
+        case XTCL:
+            leave();
+            enter(vm->pc);
+            break;
+
+        case XRET:
+            leave();
+            break;
+
+        case XJMP:
+        case XJPC:
+            if (vm->pc <= pc)
+                nback[pc]++;
+            break;
+    }
+}
+
+static char *procname(int p)
+{
+    static char buf[32];
+    int i;
+
+    if (p == main0)
+        return "main";
+    for (i = 0; i < ndsym; i++)
+    {
+        if (dsym[i].sym.type == symproc && dsym[i].start == p)
+            return dsym[i].sym.name;
+    }
+    snprintf(buf, sizeof(buf), "pc%d", p);
+    return buf;
+}
+
+/* the procedure the code at pc is in */
+static char *inproc(int pc)
+{
+    int q;
+
+    q = mapproc(pc);
+    return (q < 0) ? "?" : dsym[q].sym.name;
+}
+
+static char *xopname(int x)
+{
+    static char buf[16];
+    int i;
+
+    snprintf(buf, sizeof(buf), "%s", xname[x] + 1);
+    for (i = 0; buf[i] != '\0'; i++)
+        buf[i] = tolower(buf[i]);
+    return buf;
+}
+
+/* sort indices by the count they have in key, most first */
+static long long *key;
+
+static int bykey(const void *a, const void *b)
+{
+    long long x, y;
+
+    x = key[*(int*)a];
+    y = key[*(int*)b];
+    if (x != y)
+        return (x < y) ? 1 : -1;
+    return *(int*)a - *(int*)b;
+}
+
+static int *sorted(long long *k, int n)
+{
+    int *ix, i;
+
+    ix = emalloc(sizeof(ix[0]) * (n + 1));
+    for (i = 0; i < n; i++)
+        ix[i] = i;
+    key = k;
+    qsort(ix, n, sizeof(ix[0]), bykey);
+    return ix;
+}
+
+static void writestacks(void)
+{
+    FILE *fp;
+    int *path, i, j, n;
+
+    fp = fopen(stacks, "w");
+    if (!fp)
+    {
+        fprintf(stderr, "%s: %s\n", stacks, strerror(errno));
+        return;
+    }
+
+    path = emalloc(sizeof(path[0]) * (nnode + 1));
+    for (i = 0; i < nnode; i++)
+    {
+        if (node[i].n == 0)
+            continue;
+        n = 0;
+        for (j = i; j >= 0; j = node[j].parent)
+            path[n++] = node[j].proc;
+        while (n-- > 0)
+            fprintf(fp, "%s%s", procname(path[n]), n ? ";" : "");
+        fprintf(fp, " %lld\n", node[i].n);
+    }
+    free(path);
+    fclose(fp);
+}
+
+static void report(void)
+{
+    long long *k;
+    double ms;
+    int *ix, i, n;
+
+    ms = last - start;
+    fprintf(stderr, "profile: %lld instructions in %.3f ms\n", total, ms);
+
+    /* the exclusive counts of the procedures are those of their nodes */
+    for (i = 0; i < nnode; i++)
+    {
+        proc[node[i].proc].excl += node[i].n;
+        proc[node[i].proc].exclms += node[i].ms;
+    }
+
+    k = emalloc(sizeof(k[0]) * (main0 + 1));
+    for (i = 0; i <= main0; i++)
+        k[i] = proc[i].calls ? proc[i].excl + 1 : 0;
+    ix = sorted(k, main0 + 1);
+    fprintf(stderr, "\nprocedures, by instructions run in them:\n");
+    fprintf(stderr, "%10s %12s %12s %10s %10s  %s\n", "calls", "incl", "excl", "incl ms", "excl ms", "name");
+    for (i = 0; i <= main0 && k[ix[i]] > 0; i++)
+    {
+        n = ix[i];
+        fprintf(stderr, "%10lld %12lld %12lld %10.3f %10.3f  %s\n", proc[n].calls,
+            proc[n].incl, proc[n].excl, proc[n].inclms, proc[n].exclms, procname(n));
+    }
+    free(ix);
+    free(k);
+
+    k = emalloc(sizeof(k[0]) * NXOP);
+    for (i = 0; i < prog->inslen; i++)
+        k[dec[i]] += npc[i];
+    ix = sorted(k, NXOP);
+    fprintf(stderr, "\nops:\n");
+    for (i = 0; i < NXOP && k[ix[i]] > 0; i++)
+        fprintf(stderr, "%12lld %6.2f%%  %s\n", k[ix[i]], 100.0 * k[ix[i]] / max(total, 1), xopname(ix[i]));
+    free(ix);
+    free(k);
+
+    ix = sorted(npc, prog->inslen);
+    fprintf(stderr, "\ninstructions run the most:\n");
+    for (i = 0; i < prog->inslen && i < NTOP && npc[ix[i]] > 0; i++)
+    {
+        n = ix[i];
+        fprintf(stderr, "%12lld  pc %d\t%s %d %d\tin %s\n", npc[n], n,
+            opname(prog->wide[n].op), prog->wide[n].l, prog->wide[n].m, inproc(n));
+    }
+    free(ix);
+
+    ix = sorted(nback, prog->inslen);
+    fprintf(stderr, "\nloops, by backward jumps taken:\n");
+    for (i = 0; i < prog->inslen && i < NTOP && nback[ix[i]] > 0; i++)
+    {
+        n = ix[i];
+        fprintf(stderr, "%12lld  pc %d to %d\tin %s\n", nback[n], n, prog->wide[n].m, inproc(n));
+    }
+    free(ix);
+}
+
+/* finish the calls the program was in and write it all out, a
+   program that dies in the middle gets here from exit */
+void profclose(void)
+{
+    if (!prog)
+        return;
+    while (depth > 0)
+        leave();
+    fflush(stdout);
+    report();
+    writestacks();
+    prog = NULL;
+}
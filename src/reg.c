@@ -0,0 +1,777 @@
+#include "dat.h"
+#include "fns.h"
+
+/* the register vm, the stack code gets translated into
+   three address code that works on the slots of the frame
+   directly, every stack position has a fixed offset from bp
+   in code generated by the parser, so the temporaries of
+   an expression are just frame slots too and a statement like
+   x := y + z becomes a single instruction
+*/
+
+typedef struct Rins Rins;
+typedef struct Val Val;
+
+/* a register instruction, the slots a, b, c are
+   offsets from bp, unless the op says otherwise */
+struct Rins
+{
+    int op, a, b, c;
+};
+
+/* a value that is on the stack during translation,
+   it only gets stored into its slot when it has to be */
+struct Val
+{
+    int kind;
+    int k;
+};
+
+/* the register instructions, the K variants take a constant
+   as the last operand, the J ones branch to c if the
+   comparison of a and b is true */
+enum
+{
+    RBAD, RMOV, RMOVK, RLDU, RSTU, RNEG, RODD,
+    RADD, RSUB, RMUL, RDIV, RMOD, REQL, RNEQ, RLSS, RLEQ, RGTR, RGEQ,
+    RADDK, RSUBK, RMULK, RDIVK, RMODK, REQLK, RNEQK, RLSSK, RLEQK, RGTRK, RGEQK,
+    RJEQL, RJNEQ, RJLSS, RJLEQ, RJGTR, RJGEQ,
+    RJEQLK, RJNEQK, RJLSSK, RJLEQK, RJGTRK, RJGEQK,
+    RJZ, RJMP, RCAL, RTCL, RRET, RWRITE, RREAD
+};
+
+/* what a value on the translation stack is */
+enum
+{
+    VMEM, VCON, VVAR
+};
+
+#define NVAL 64
+
+/* the register code, with the stack code pc every
+   instruction came from and how much stack a frame can use */
+static Rins *rcode;
+static int  *rsrc;
+static int   rlen;
+static int   rcap;
+static int   rtop;
+
+/* translation state */
+static int *depth;
+static int *rmap;
+static char *label;
+static Val  vs[NVAL];
+static int  nmem;
+static int  sd;
+static int  lastw;
+static int  curpc;
+
+static int pw(int v)
+{
+    return v & (MAX_CODE_LENGTH-1);
+}
+
+/* register op for a stack OPR arithmetic/relational op */
+static int binop(int m)
+{
+    static const int ops[] =
+    {
+        [OADD] = RADD, [OSUB] = RSUB, [OMUL] = RMUL, [ODIV] = RDIV,
+        [OMOD] = RMOD, [OEQL] = REQL, [ONEQ] = RNEQ, [OLSS] = RLSS,
+        [OLEQ] = RLEQ, [OGTR] = RGTR, [OGEQ] = RGEQ
+    };
+
+    if (m < 0 || m >= nelem(ops))
+        return -1;
+    return (ops[m] != 0) ? ops[m] : -1;
+}
+
+/* the op to use when the operands of op get swapped */
+static int mirror(int op)
+{
+    switch (op)
+    {
+        case RADD: case RMUL: case REQL: case RNEQ:
+            return op;
+        case RLSS: return RGTR;
+        case RLEQ: return RGEQ;
+        case RGTR: return RLSS;
+        case RGEQ: return RLEQ;
+    }
+    return -1;
+}
+
+/* the branch taken when the comparison op is false */
+static int invert(int op)
+{
+    static const int ops[] =
+    {
+        [REQL - REQL] = RJNEQ, [RNEQ - REQL] = RJEQL,
+        [RLSS - REQL] = RJGEQ, [RLEQ - REQL] = RJGTR,
+        [RGTR - REQL] = RJLEQ, [RGEQ - REQL] = RJLSS
+    };
+
+    if (op >= REQL && op <= RGEQ)
+        return ops[op - REQL];
+    if (op >= REQLK && op <= RGEQK)
+        return ops[op - REQLK] + (RJEQLK - RJEQL);
+    return -1;
+}
+
+/* fold a operation on two constants */
+static int fold(int op, int a, int b, int *r)
+{
+    switch (op)
+    {
+        case RADD: *r = a + b; break;
+        case RSUB: *r = a - b; break;
+        case RMUL: *r = a * b; break;
+        case RDIV: if (b == 0) return 0; *r = a / b; break;
+        case RMOD: if (b == 0) return 0; *r = a % b; break;
+        case REQL: *r = (a == b); break;
+        case RNEQ: *r = (a != b); break;
+        case RLSS: *r = (a < b); break;
+        case RLEQ: *r = (a <= b); break;
+        case RGTR: *r = (a > b); break;
+        case RGEQ: *r = (a >= b); break;
+        default:   return 0;
+    }
+    return 1;
+}
+
+static int remit(int op, int a, int b, int c)
+{
+    Rins *r;
+
+    if (rlen >= rcap)
+    {
+        rcap = max(rcap * 2, 1024);
+        rcode = realloc(rcode, rcap * sizeof(rcode[0]));
+        rsrc = realloc(rsrc, rcap * sizeof(rsrc[0]));
+        if (!rcode || !rsrc)
+            die("oom trying to allocate register code");
+    }
+    rsrc[rlen] = curpc;
+
+    r = &rcode[rlen];
+    r->op = op;
+    r->a = a;
+    r->b = b;
+    r->c = c;
+    return rlen++;
+}
+
+/* store the value at stack position p into its slot */
+static void mat(int p)
+{
+    Val *v;
+
+    v = &vs[p - nmem];
+    if (v->kind == VCON)
+        remit(RMOVK, p, v->k, 0);
+    else if (v->kind == VVAR)
+        remit(RMOV, p, v->k, 0);
+    v->kind = VMEM;
+}
+
+/* store everything that is still pending, at the end
+   of a block everything has to be where the stack vm has it */
+static void flush(void)
+{
+    int p;
+
+    for (p = nmem; p < sd; p++)
+        mat(p);
+    nmem = sd;
+}
+
+/* slot x is about to get written, so values
+   that are still reading it have to be stored first */
+static int clobber(int x)
+{
+    int p, n;
+
+    n = 0;
+    for (p = nmem; p < sd; p++)
+    {
+        if (vs[p - nmem].kind == VVAR && vs[p - nmem].k == x)
+        {
+            mat(p);
+            n++;
+        }
+    }
+    return n;
+}
+
+static void push(int kind, int k)
+{
+    if (sd - nmem >= NVAL)
+        flush();
+
+    vs[sd - nmem].kind = kind;
+    vs[sd - nmem].k = k;
+    sd++;
+}
+
+static Val pop(void)
+{
+    Val v;
+
+    sd--;
+    if (sd < nmem)
+    {
+        nmem = sd;
+        v.kind = VMEM;
+        v.k = 0;
+        return v;
+    }
+    return vs[sd - nmem];
+}
+
+/* the slot a popped value at stack position p can be read from */
+static int slot(Val v, int p)
+{
+    if (v.kind == VVAR)
+        return v.k;
+    if (v.kind == VCON)
+        remit(RMOVK, p, v.k, 0);
+    return p;
+}
+
+/* push the result of the instruction just emitted */
+static void result(void)
+{
+    push(VMEM, 0);
+    lastw = rlen - 1;
+}
+
+/* is the top of the stack at p the result of the last instruction */
+static int fresh(Val v, int p)
+{
+    return v.kind == VMEM && lastw == rlen - 1 && lastw >= 0 && rcode[lastw].a == p;
+}
+
+static void gbinop(int op)
+{
+    Val a, b;
+    int p, k, mop;
+
+    b = pop();
+    a = pop();
+    p = sd;
+
+    if (a.kind == VCON && b.kind == VCON && fold(op, a.k, b.k, &k))
+    {
+        push(VCON, k);
+        return;
+    }
+
+    if (b.kind == VCON)
+        remit(op + (RADDK - RADD), p, slot(a, p), b.k);
+    else if (a.kind == VCON && (mop = mirror(op)) >= 0)
+        remit(mop + (RADDK - RADD), p, slot(b, p + 1), a.k);
+    else
+    {
+        k = slot(a, p);
+        remit(op, p, k, slot(b, p + 1));
+    }
+    result();
+}
+
+static void gunop(int op)
+{
+    Val a;
+    int p;
+
+    a = pop();
+    p = sd;
+    if (a.kind == VCON)
+    {
+        push(VCON, (op == RNEG) ? -a.k : a.k % 2);
+        return;
+    }
+    remit(op, p, slot(a, p), 0);
+    result();
+}
+
+static void gstore(int x)
+{
+    Val v;
+    int p;
+
+    v = pop();
+    p = sd;
+    if (clobber(x) == 0 && fresh(v, p))
+    {
+        rcode[lastw].a = x;
+        return;
+    }
+
+    if (v.kind == VCON)
+        remit(RMOVK, x, v.k, 0);
+    else
+        remit(RMOV, x, slot(v, p), 0);
+}
+
+static void gbranch(int target)
+{
+    Val v;
+    Rins r;
+    int p, op;
+
+    v = pop();
+    p = sd;
+    if (v.kind == VCON)
+    {
+        flush();
+        if (v.k == 0)
+            remit(RJMP, 0, 0, target);
+        return;
+    }
+
+    if (fresh(v, p) && (op = invert(rcode[lastw].op)) >= 0)
+    {
+        r = rcode[--rlen];
+        flush();
+        remit(op, r.b, r.c, target);
+        return;
+    }
+
+    op = slot(v, p);
+    flush();
+    remit(RJZ, op, 0, target);
+}
+
+/* find the stack depth at every instruction, the parser
+   always generates code where it is the same no matter how
+   the instruction is reached, code that doesn't do that
+   can't be translated and runs on the stack vm */
+static int walk(Ins *ins, int len)
+{
+    int *work, nwork, pc, d, n, i;
+    int succ[2], nsucc;
+    Ins *p;
+
+    work = emalloc(sizeof(work[0]) * (len + 1));
+    nwork = 0;
+
+    for (i = 0; i < len; i++)
+        depth[i] = -1;
+
+    depth[0] = 0;
+    label[0] = 1;
+    work[nwork++] = 0;
+    while (nwork > 0)
+    {
+        pc = work[--nwork];
+        p = &ins[pc];
+        d = depth[pc];
+        nsucc = 0;
+
+        switch (p->op)
+        {
+            case OLIT: case OLOD: case OSIO2:
+                d++;
+                succ[nsucc++] = pc + 1;
+                break;
+
+            case OSTO: case OSIO1: case OLDS:
+                d--;
+                succ[nsucc++] = pc + 1;
+                break;
+
+            case OINC:
+                d += p->m;
+                succ[nsucc++] = pc + 1;
+                break;
+
+            case OJMP:
+                succ[nsucc++] = pw(p->m);
+                break;
+
+            case OJPC:
+                d--;
+                succ[nsucc++] = pc + 1;
+                succ[nsucc++] = pw(p->m);
+                break;
+
+            case OCAL:
+                n = pw(p->m);
+                if (n >= len)
+                    goto fail;
+                label[n] = 1;
+                if (depth[n] < 0)
+                {
+                    depth[n] = 0;
+                    work[nwork++] = n;
+                }
+                else if (depth[n] != 0)
+                    goto fail;
+
+                label[pc + 1] = 1;
+                succ[nsucc++] = pc + 1;
+                break;
+
+            case OTCL:
+                n = pw(p->m);
+                if (n >= len)
+                    goto fail;
+                label[n] = 1;
+                if (depth[n] < 0)
+                {
+                    depth[n] = 0;
+                    work[nwork++] = n;
+                }
+                else if (depth[n] != 0)
+                    goto fail;
+                break;
+
+            case OOPR:
+                if (p->m == ORET)
+                    break;
+                if (p->m == ONEG || p->m == OODD)
+                {
+                    succ[nsucc++] = pc + 1;
+                    break;
+                }
+                if (binop(p->m) < 0)
+                    break;
+                d--;
+                succ[nsucc++] = pc + 1;
+                break;
+        }
+
+        if (d < 0 || d >= MAX_STACK_HEIGHT / 2)
+            goto fail;
+
+        for (i = 0; i < nsucc; i++)
+        {
+            n = succ[i];
+            if (n >= len)
+                goto fail;
+            if (n != pc + 1)
+                label[n] = 1;
+            if (depth[n] < 0)
+            {
+                depth[n] = d;
+                work[nwork++] = n;
+            }
+            else if (depth[n] != d)
+                goto fail;
+        }
+    }
+
+    free(work);
+    return 0;
+
+fail:
+    free(work);
+    return -1;
+}
+
+/* translate the stack code to register code, returns -1 if it can't,
+   top is how much stack a frame can use when it is known, CAL checks it */
+int regtrans(Ins *ins, int len, int top)
+{
+    Ins *p;
+    Rins *r;
+    Val v;
+    int pc, live, rc, i;
+
+    if (len <= 0)
+        return -1;
+
+    depth = emalloc(sizeof(depth[0]) * (len + 1));
+    rmap = emalloc(sizeof(rmap[0]) * (len + 1));
+    label = emalloc(len + 1);
+    rlen = 0;
+    rtop = top;
+    rc = -1;
+
+    if (walk(ins, len) < 0)
+        goto out;
+
+    live = 0;
+    lastw = -1;
+    for (pc = 0; pc < len; pc++)
+    {
+        if (depth[pc] < 0)
+        {
+            live = 0;
+            continue;
+        }
+
+        if (label[pc])
+        {
+            if (live)
+                flush();
+            sd = nmem = depth[pc];
+            lastw = -1;
+        }
+        rmap[pc] = rlen;
+        live = 1;
+        curpc = pc;
+
+        p = &ins[pc];
+        switch (p->op)
+        {
+            case OLIT:
+                push(VCON, p->m);
+                break;
+
+            case OLOD:
+                if (p->l == 0 && p->m < nmem)
+                    push(VVAR, p->m);
+                else
+                {
+                    if (p->l == 0)
+                        remit(RMOV, sd, p->m, 0);
+                    else
+                        remit(RLDU, sd, p->l, p->m);
+                    result();
+                }
+                break;
+
+            case OSTO:
+                if (p->l == 0)
+                    gstore(p->m);
+                else
+                {
+                    v = pop();
+                    i = slot(v, sd);
+                    flush();
+                    remit(RSTU, p->l, p->m, i);
+                }
+                break;
+
+            case OOPR:
+                if (p->m == ORET)
+                {
+                    remit(RRET, 0, 0, 0);
+                    live = 0;
+                }
+                else if (p->m == ONEG)
+                    gunop(RNEG);
+                else if (p->m == OODD)
+                    gunop(RODD);
+                else if (binop(p->m) >= 0)
+                    gbinop(binop(p->m));
+                else
+                {
+                    remit(RBAD, p->op, p->l, p->m);
+                    live = 0;
+                }
+                break;
+
+            case OCAL:
+                flush();
+                remit(RCAL, p->l, pw(p->m), sd);
+                break;
+
+            case OTCL:
+                flush();
+                remit(RTCL, 0, pw(p->m), 0);
+                live = 0;
+                break;
+
+            case OINC:
+                flush();
+                sd += p->m;
+                nmem = sd;
+                break;
+
+            case OJMP:
+                flush();
+                remit(RJMP, 0, 0, pw(p->m));
+                live = 0;
+                break;
+
+            case OJPC:
+                gbranch(pw(p->m));
+                break;
+
+            case OSIO1:
+                v = pop();
+                remit(RWRITE, slot(v, sd), 0, 0);
+                break;
+
+            case OSIO2:
+                remit(RREAD, sd, 0, 0);
+                result();
+                break;
+
+            case OLDS:
+                v = pop();
+                i = slot(v, sd);
+                clobber(sd + p->m);
+                remit(RMOV, sd + p->m, i, 0);
+                break;
+
+            default:
+                remit(RBAD, p->op, p->l, p->m);
+                live = 0;
+                break;
+        }
+    }
+
+    /* point the branches at register code */
+    for (i = 0; i < rlen; i++)
+    {
+        r = &rcode[i];
+        if (r->op == RCAL || r->op == RTCL)
+            r->b = rmap[r->b];
+        else if (r->op >= RJEQL && r->op <= RJMP)
+            r->c = rmap[r->c];
+    }
+    rc = 0;
+
+out:
+    free(depth);
+    free(rmap);
+    free(label);
+    return rc;
+}
+
+/* the stack is masked with stkspan, kept in a local so the
+   stores to the stack don't make the loop load it again and
+   unsigned so the indices it gives need no sign extending */
+#define sw(v) ((unsigned)(v) & mask)
+
+static int base(int *stk, int l, int b, unsigned mask)
+{
+    while (l > 0)
+    {
+        b = sw(stk[sw(b + 1)]);
+        l--;
+    }
+    return b;
+}
+
+/* run the register code on the stack */
+void regexec(int *stk)
+{
+    Rins *r;
+    unsigned mask;
+    int rpc, bp, sp, v;
+
+#define S(x) stk[sw(bp + (x))]
+
+    mask = stkspan() - 1;
+    bp = 1;
+    rpc = 0;
+    for (;;)
+    {
+        r = &rcode[rpc++];
+        COUNT;
+        switch (r->op)
+        {
+            case RMOV:   S(r->a) = S(r->b); break;
+            case RMOVK:  S(r->a) = r->b; break;
+            case RLDU:   S(r->a) = stk[sw(base(stk, r->b, bp, mask) + r->c)]; break;
+            case RSTU:   stk[sw(base(stk, r->a, bp, mask) + r->b)] = S(r->c); break;
+            case RNEG:   S(r->a) = -S(r->b); break;
+            case RODD:   S(r->a) = S(r->b) % 2; break;
+
+            case RADD:   S(r->a) = S(r->b) + S(r->c); break;
+            case RSUB:   S(r->a) = S(r->b) - S(r->c); break;
+            case RMUL:   S(r->a) = S(r->b) * S(r->c); break;
+            case RDIV:
+                v = S(r->c);
+                if (v == 0)
+                    die("vm: divide by 0");
+                S(r->a) = S(r->b) / v;
+                break;
+            case RMOD:
+                v = S(r->c);
+                if (v == 0)
+                    die("vm: mod by 0");
+                S(r->a) = S(r->b) % v;
+                break;
+            case REQL:   S(r->a) = (S(r->b) == S(r->c)); break;
+            case RNEQ:   S(r->a) = (S(r->b) != S(r->c)); break;
+            case RLSS:   S(r->a) = (S(r->b) <  S(r->c)); break;
+            case RLEQ:   S(r->a) = (S(r->b) <= S(r->c)); break;
+            case RGTR:   S(r->a) = (S(r->b) >  S(r->c)); break;
+            case RGEQ:   S(r->a) = (S(r->b) >= S(r->c)); break;
+
+            case RADDK:  S(r->a) = S(r->b) + r->c; break;
+            case RSUBK:  S(r->a) = S(r->b) - r->c; break;
+            case RMULK:  S(r->a) = S(r->b) * r->c; break;
+            case RDIVK:
+                if (r->c == 0)
+                    die("vm: divide by 0");
+                S(r->a) = S(r->b) / r->c;
+                break;
+            case RMODK:
+                if (r->c == 0)
+                    die("vm: mod by 0");
+                S(r->a) = S(r->b) % r->c;
+                break;
+            case REQLK:  S(r->a) = (S(r->b) == r->c); break;
+            case RNEQK:  S(r->a) = (S(r->b) != r->c); break;
+            case RLSSK:  S(r->a) = (S(r->b) <  r->c); break;
+            case RLEQK:  S(r->a) = (S(r->b) <= r->c); break;
+            case RGTRK:  S(r->a) = (S(r->b) >  r->c); break;
+            case RGEQK:  S(r->a) = (S(r->b) >= r->c); break;
+
+            case RJEQL:  if (S(r->a) == S(r->b)) rpc = r->c; break;
+            case RJNEQ:  if (S(r->a) != S(r->b)) rpc = r->c; break;
+            case RJLSS:  if (S(r->a) <  S(r->b)) rpc = r->c; break;
+            case RJLEQ:  if (S(r->a) <= S(r->b)) rpc = r->c; break;
+            case RJGTR:  if (S(r->a) >  S(r->b)) rpc = r->c; break;
+            case RJGEQ:  if (S(r->a) >= S(r->b)) rpc = r->c; break;
+
+            case RJEQLK: if (S(r->a) == r->b) rpc = r->c; break;
+            case RJNEQK: if (S(r->a) != r->b) rpc = r->c; break;
+            case RJLSSK: if (S(r->a) <  r->b) rpc = r->c; break;
+            case RJLEQK: if (S(r->a) <= r->b) rpc = r->c; break;
+            case RJGTRK: if (S(r->a) >  r->b) rpc = r->c; break;
+            case RJGEQK: if (S(r->a) >= r->b) rpc = r->c; break;
+
+            case RJZ:    if (S(r->a) == 0) rpc = r->c; break;
+            case RJMP:   rpc = r->c; break;
+
+            case RCAL:
+                sp = sw(bp + r->c - 1);
+                stk[sw(sp + 1)] = 0;
+                stk[sw(sp + 2)] = base(stk, r->a, bp, mask);
+                stk[sw(sp + 3)] = bp;
+                stk[sw(sp + 4)] = rpc;
+                bp = sw(sp + 1);
+                rpc = r->b;
+                if (rtop > 0 && bp + rtop > stacklimit)
+                    die("vm: stack overflow at pc %d", rsrc[r - rcode]);
+                if (bp <= 0)
+                    return;
+                break;
+
+            case RTCL:
+                S(0) = 0;
+                rpc = r->b;
+                break;
+
+            case RRET:
+                sp = sw(bp - 1);
+                rpc = stk[sw(sp + 4)];
+                bp = stk[sw(sp + 3)];
+                if (sp <= 0)
+                    return;
+                break;
+
+            case RWRITE:
+                printf("Value on top of the stack: %d\n", S(r->a));
+                break;
+
+            case RREAD:
+                S(r->a) = readnum();
+                break;
+
+            default:
+                fprintf(stderr, "vm: unknown instruction: OP: %d L: %d M: %d\n", r->a, r->b, r->c);
+                return;
+        }
+    }
+
+#undef S
+#undef sw
+}
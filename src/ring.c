@@ -0,0 +1,267 @@
+#include "dat.h"
+#include "fns.h"
+
+#include <pthread.h>
+#include <time.h>
+#include <sched.h>
+
+/* the binary trace, -g writes a record of every instruction
+   the traced loop runs into a ring the loop never waits on
+   unless it is full, a thread of its own takes them out and
+   writes them to the file, the only thing the two share is
+   where each of them is in the ring
+
+   magic    "PL0T"
+   version  RINGVERSION
+   order    0x01020304 in the byte order of the writer
+   ncode    instructions in the code
+
+   then ncode Ins of the code and a Trec for every instruction
+   up to the end of the file, all 4 byte ints, --decode turns
+   it back into what -v prints when the program runs, it works
+   the stack out from the code and the top of the stack in
+   every record, so the records stay small */
+
+enum
+{
+    RINGVERSION = 1,
+    RINGORDER   = 0x01020304,
+    RINGSIZE    = 1 << 16
+};
+
+typedef struct
+{
+    char     magic[4];
+    uint32_t version;
+    uint32_t order;
+    uint32_t ncode;
+} Thead;
+
+/* the pc of the instruction, the pc after it, its op, the
+   registers after it and the top of the stack */
+typedef struct
+{
+    int32_t pc, next, op;
+    int32_t sp, bp, top;
+} Trec;
+
+static Trec ring[RINGSIZE];
+static unsigned long head;
+static unsigned long tail;
+static int done;
+static FILE *tfp;
+static char *tname;
+static pthread_t flusher;
+
+/* take what is in the ring out to the file until it is closed */
+static void *flush(void *arg)
+{
+    struct timespec ts;
+    unsigned long h, t, n;
+
+    (void)arg;
+    ts.tv_sec = 0;
+    ts.tv_nsec = 200000;
+    t = tail;
+    for (;;)
+    {
+        h = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+        if (h == t)
+        {
+            if (__atomic_load_n(&done, __ATOMIC_ACQUIRE) && h == __atomic_load_n(&head, __ATOMIC_ACQUIRE))
+                break;
+            nanosleep(&ts, NULL);
+            continue;
+        }
+
+        /* up to the end of the ring, the rest next time around */
+        n = min(h - t, RINGSIZE - (t & (RINGSIZE - 1)));
+        if (fwrite(&ring[t & (RINGSIZE - 1)], sizeof(ring[0]), n, tfp) != n)
+            fprintf(stderr, "%s: %s\n", tname, strerror(errno));
+        t += n;
+        __atomic_store_n(&tail, t, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+/* start tracing the run of p into f */
+void ringopen(char *f, Prog *p)
+{
+    Thead h;
+    int32_t w[3];
+    int i;
+
+    tfp = fopen(f, "wb");
+    if (!tfp)
+        die("%s: %s", f, strerror(errno));
+    tname = f;
+
+    memcpy(h.magic, "PL0T", 4);
+    h.version = RINGVERSION;
+    h.order = RINGORDER;
+    h.ncode = p->inslen;
+    fwrite(&h, sizeof(h), 1, tfp);
+    for (i = 0; i < p->inslen; i++)
+    {
+        w[0] = p->wide[i].op;
+        w[1] = p->wide[i].l;
+        w[2] = p->wide[i].m;
+        fwrite(w, sizeof(w), 1, tfp);
+    }
+
+    head = tail = 0;
+    done = 0;
+    if (pthread_create(&flusher, NULL, flush, NULL) != 0)
+        die("can't start the trace thread");
+    atexit(ringclose);
+}
+
+/* the instruction vm just ran */
+void ringput(VM *vm)
+{
+    Trec *r;
+
+    while (head - __atomic_load_n(&tail, __ATOMIC_ACQUIRE) == RINGSIZE)
+        sched_yield();
+
+    r = &ring[head & (RINGSIZE - 1)];
+    r->pc = vm->oldpc;
+    r->next = vm->pc;
+    r->op = (vm->oldpc < vm->prog->inslen) ? vm->prog->wide[vm->oldpc].op : 0;
+    r->sp = vm->sp;
+    r->bp = vm->bp;
+    r->top = (vm->sp >= 0 && vm->sp < vm->stklen) ? vm->stk[vm->sp] : 0;
+    __atomic_store_n(&head, head + 1, __ATOMIC_RELEASE);
+}
+
+/* wait for the ring to get written out, a program that dies
+   in the middle gets here from exit */
+void ringclose(void)
+{
+    if (!tfp)
+        return;
+    __atomic_store_n(&done, 1, __ATOMIC_RELEASE);
+    pthread_join(flusher, NULL);
+    fclose(tfp);
+    tfp = NULL;
+}
+
+/* the word at i of the stack being worked out, it grows
+   like the stack of the machine did */
+static int *word(VM *vm, int i)
+{
+    if (i < 0)
+        die("%s: the trace goes below the stack", tname);
+    if (i >= vm->stklen)
+        stkgrow(vm, i + 1);
+    return &vm->stk[i];
+}
+
+static int base(VM *vm, int l, int b)
+{
+    while (l-- > 0)
+        b = *word(vm, b + 1);
+    return b;
+}
+
+/* print the trace in f like -v prints the run */
+int ringdecode(char *f)
+{
+    FILE *fp;
+    Thead h;
+    Trec r;
+    Code *code;
+    Ins in;
+    Prog *p;
+    VM *vm;
+    int32_t w[3];
+    int sp, bp;
+    uint32_t i;
+
+    fp = fopen(f, "rb");
+    if (!fp)
+        die("%s: %s", f, strerror(errno));
+    tname = f;
+    if (fread(&h, sizeof(h), 1, fp) != 1 || memcmp(h.magic, "PL0T", 4) != 0)
+        die("%s: not a trace file", f);
+    if (h.version != RINGVERSION || h.order != RINGORDER)
+        die("%s: trace file from another version or byte order", f);
+    if (h.ncode >= MAX_CODE_LENGTH)
+        die("%s: too much code", f);
+
+    code = emalloc(sizeof(code[0]) * (h.ncode + 1));
+    for (i = 0; i < h.ncode; i++)
+    {
+        if (fread(w, sizeof(w), 1, fp) != 1)
+            die("%s: the code is cut short", f);
+        in.op = w[0];
+        in.l = w[1];
+        in.m = w[2];
+        code[i] = pack(&in);
+    }
+
+    /* the code is loaded the way -v runs it */
+    verbose = 1;
+    loadinsbuf(code, h.ncode);
+    p = takeprog();
+    vm = newvm();
+    vmreset(vm, p, stdin, stdout, stderr);
+    printins(vm, 0);
+
+    while (fread(&r, sizeof(r), 1, fp) == 1)
+    {
+        sp = vm->sp;
+        bp = vm->bp;
+        in = ((uint32_t)r.pc < h.ncode) ? p->wide[r.pc] : (Ins){0, 0, 0};
+
+        /* the writes to the stack other than the new top */
+        switch (decode(&in))
+        {
+            case XSTO:
+                *word(vm, base(vm, in.l, bp) + in.m) = *word(vm, sp);
+                break;
+
+            case XLDS:
+                *word(vm, sp + in.m) = *word(vm, sp);
+                break;
+
+            case XCAL:
+                *word(vm, sp + 1) = 0;
+                *word(vm, sp + 2) = base(vm, in.l, bp);
+                *word(vm, sp + 3) = bp;
+                *word(vm, sp + 4) = r.pc + 1;
+                vm->ar[r.bp - 1] = 1;
+                vm->lastar = sp + FRAME;
+                break;
+
+            case XTCL:
+                *word(vm, bp) = 0;
+                break;
+
+            case XRET:
+                vm->ar[bp - 1] = 0;
+                vm->lastar = (r.sp <= 0) ? 0 : r.bp + FRAME;
+                break;
+
+            case XSIO1:
+                fprintf(vm->out, "Value on top of the stack: %d\n", *word(vm, sp));
+                break;
+
+            case XSIO2:
+                fprintf(vm->out, "Enter a value to be placed on top of the stack: ");
+                break;
+        }
+
+        vm->oldpc = r.pc;
+        vm->pc = r.next;
+        vm->sp = r.sp;
+        vm->bp = r.bp;
+        if (r.sp >= 0)
+            *word(vm, r.sp) = r.top;
+        printins(vm, 1);
+    }
+
+    fclose(fp);
+    freevm(vm);
+    return 0;
+}
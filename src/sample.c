@@ -0,0 +1,165 @@
+#define _DEFAULT_SOURCE
+#include "dat.h"
+#include "fns.h"
+
+#ifdef __unix__
+#include <signal.h>
+#include <sys/time.h>
+#endif
+
+/* the sampler, --sample, a profiling timer goes off every
+   SAMPLEUS of cpu the process uses and the handler counts the pc
+   the machine is at, the one every loop of the stack vm keeps in
+   vm->oldpc, so the program runs in the loop it always does and
+   the only cost is the signal, when it ends the samples get added
+   up by the source line of their pc and the heat map file gets
+   the source with the share of the samples of every line
+
+   the code needs the lines the compiler keeps, code loaded with
+   -p only has them when the file it was dumped to does */
+
+enum
+{
+    SAMPLEUS = 1000,
+    BAR      = 40
+};
+
+static VM *vm;
+static Prog *prog;
+static long long *hits;
+static volatile long long nsample;
+static volatile long long nout;
+
+#ifdef __unix__
+static void tick(int sig)
+{
+    int pc;
+
+    (void)sig;
+    pc = vm->oldpc;
+    if (pc >= 0 && pc < prog->xlen)
+        hits[prog->xsrc[pc]]++;
+    else
+        nout++;
+    nsample++;
+}
+
+/* start sampling the run of machine m */
+void sampleopen(VM *m)
+{
+    struct sigaction sa;
+    struct itimerval it;
+
+    vm = m;
+    prog = m->prog;
+    if (!prog->loc)
+        die("--sample needs the source lines of the code");
+    hits = emalloc(sizeof(hits[0]) * (prog->inslen + 1));
+    nsample = nout = 0;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = tick;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGPROF, &sa, NULL) < 0)
+        die("can't catch SIGPROF: %s", strerror(errno));
+
+    it.it_interval.tv_sec = 0;
+    it.it_interval.tv_usec = SAMPLEUS;
+    it.it_value = it.it_interval;
+    if (setitimer(ITIMER_PROF, &it, NULL) < 0)
+        die("can't start the profiling timer: %s", strerror(errno));
+    atexit(sampleclose);
+}
+
+static void stop(void)
+{
+    struct itimerval it;
+
+    memset(&it, 0, sizeof(it));
+    setitimer(ITIMER_PROF, &it, NULL);
+    signal(SIGPROF, SIG_IGN);
+}
+#else
+void sampleopen(VM *m)
+{
+    (void)m;
+    die("--sample needs a unix profiling timer");
+}
+
+static void stop(void)
+{
+}
+#endif
+
+/* the source with the samples of every line next to it */
+static void writeheat(void)
+{
+    FILE *src, *fp;
+    long long *n, most;
+    char buf[1024];
+    int i, nline, l, len, bar, c;
+
+    src = fopen(prog->src, "r");
+    if (!src)
+    {
+        fprintf(stderr, "%s: %s\n", prog->src, strerror(errno));
+        return;
+    }
+    fp = fopen(heatmap, "w");
+    if (!fp)
+    {
+        fprintf(stderr, "%s: %s\n", heatmap, strerror(errno));
+        fclose(src);
+        return;
+    }
+
+    nline = 0;
+    for (i = 0; i < prog->inslen; i++)
+        nline = max(nline, prog->loc[i].line);
+    n = emalloc(sizeof(n[0]) * (nline + 1));
+    for (i = 0; i < prog->inslen; i++)
+    {
+        if (prog->loc[i].line > 0)
+            n[prog->loc[i].line] += hits[i];
+    }
+    most = 1;
+    for (l = 1; l <= nline; l++)
+        most = max(most, n[l]);
+
+    fprintf(fp, "%s: %lld samples, asked for every %d us of cpu, %lld outside the code\n\n",
+        prog->src, nsample, SAMPLEUS, nout);
+    for (l = 1; fgets(buf, sizeof(buf), src); l++)
+    {
+        /* the rest of a line too long for the buffer is left out */
+        len = strcspn(buf, "\n");
+        if (buf[len] != '\n')
+            while ((c = getc(src)) != EOF && c != '\n')
+                ;
+        buf[len] = '\0';
+        if (l > nline || n[l] == 0)
+        {
+            fprintf(fp, "%10s %6s %*s %4d  %s\n", "", "", BAR, "", l, buf);
+            continue;
+        }
+
+        bar = (n[l] * BAR + most - 1) / most;
+        fprintf(fp, "%10lld %5.1f%% %.*s%*s %4d  %s\n", n[l], 100.0 * n[l] / max(nsample, 1),
+            bar, "########################################", BAR - bar, "", l, buf);
+    }
+
+    free(n);
+    fclose(fp);
+    fclose(src);
+}
+
+/* stop the timer and write the heat map, a program that dies in
+   the middle gets here from exit */
+void sampleclose(void)
+{
+    if (!prog)
+        return;
+    stop();
+    writeheat();
+    prog = NULL;
+}
@@ -0,0 +1,213 @@
+#include "dat.h"
+#include "fns.h"
+
+/* snapshots of a running machine, what it needs to go on from
+   where it was in another process running the same code:
+
+   magic    "PL0S"
+   version  SNAPVERSION
+   order    0x01020304 in the byte order of the writer
+   hash     Prog.hash of the code it was running
+   used     instructions it had run
+   sp, bp   the registers
+   pc       the pc in the loaded code, not the fused one
+   nstk     words of the stack that follow
+
+   the stack is the part of it that isn't zero, with the return
+   addresses of the frames turned into pcs of the loaded code
+   too, so a snapshot doesn't depend on how the code got fused,
+   the display gets built again from the frames when it gets
+   loaded, input and output are whatever the new process has
+
+   they only get taken between slices, where the pc is always
+   at the start of a fused instruction */
+
+enum
+{
+    SNAPVERSION = 1,
+    SNAPORDER   = 0x01020304
+};
+
+typedef struct
+{
+    char     magic[4];
+    uint32_t version;
+    uint32_t order;
+    uint32_t hash;
+    int64_t  used;
+    int32_t  sp;
+    int32_t  bp;
+    int32_t  pc;
+    uint32_t nstk;
+} Snap;
+
+/* the fused pc of the instruction at pc in the loaded code */
+static int fusedpc(Prog *p, int pc)
+{
+    int lo, hi, mid;
+
+    lo = 0;
+    hi = p->xlen;
+    while (lo <= hi)
+    {
+        mid = lo + (hi - lo) / 2;
+        if (p->xsrc[mid] == pc)
+            return mid;
+        if (p->xsrc[mid] < pc)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+    return -1;
+}
+
+/* write a snapshot of vm to f, it goes to a new file that
+   replaces f when it is all there, so getting killed while
+   writing it leaves the last one */
+int savesnap(VM *vm, char *f)
+{
+    Prog *p;
+    Snap h;
+    FILE *fp;
+    char *tmp;
+    int *stk;
+    int n, b, ra;
+
+    p = vm->prog;
+    for (n = vm->stklen; n > vm->sp + 1 && vm->stk[n - 1] == 0; n--)
+        ;
+    stk = emalloc(sizeof(stk[0]) * n);
+    memcpy(stk, vm->stk, sizeof(stk[0]) * n);
+
+    /* every frame but the one of the main program has the
+       frame it returns to below it */
+    for (b = vm->bp; b > 1; b = stk[b + 2])
+    {
+        ra = (b + 3 < n) ? stk[b + 3] : -1;
+        if (ra < 0 || stk[b + 2] >= b)
+        {
+            fprintf(vm->err, "vm: can't take a snapshot, the frames on the stack don't add up\n");
+            free(stk);
+            return -1;
+        }
+        stk[b + 3] = p->xsrc[min(ra, p->xlen)];
+    }
+
+    memcpy(h.magic, "PL0S", 4);
+    h.version = SNAPVERSION;
+    h.order = SNAPORDER;
+    h.hash = p->hash;
+    h.used = vm->used;
+    h.sp = vm->sp;
+    h.bp = vm->bp;
+    h.pc = p->xsrc[min(vm->pc, p->xlen)];
+    h.nstk = n;
+
+    /* what the program printed goes out before the snapshot
+       that says it got that far */
+    fflush(vm->out);
+
+    tmp = emalloc(strlen(f) + 5);
+    sprintf(tmp, "%s.tmp", f);
+    fp = fopen(tmp, "wb");
+    if (!fp)
+    {
+        fprintf(vm->err, "%s: %s\n", tmp, strerror(errno));
+        free(tmp);
+        free(stk);
+        return -1;
+    }
+
+    b = fwrite(&h, sizeof(h), 1, fp) == 1 && fwrite(stk, sizeof(stk[0]), n, fp) == (size_t)n;
+    b = fclose(fp) == 0 && b;
+    if (!b || rename(tmp, f) < 0)
+    {
+        fprintf(vm->err, "%s: %s\n", f, strerror(errno));
+        remove(tmp);
+        b = 0;
+    }
+
+    free(tmp);
+    free(stk);
+    return b ? 0 : -1;
+}
+
+/* load the snapshot in f into vm, which has been reset to run
+   the code it was taken of, returns -1 when it is of some
+   other code */
+int loadsnap(VM *vm, char *f)
+{
+    Prog *p;
+    Snap h;
+    FILE *fp;
+    int *stk, *fb, *fpc;
+    int nf, b, pc, l, i;
+
+    p = vm->prog;
+    fp = fopen(f, "rb");
+    if (!fp)
+        die("%s: %s", f, strerror(errno));
+
+    if (fread(&h, sizeof(h), 1, fp) != 1)
+        die("%s: truncated snapshot", f);
+    if (memcmp(h.magic, "PL0S", 4) != 0)
+        die("%s: not a snapshot", f);
+    if (h.order != SNAPORDER)
+        die("%s: snapshot has the wrong byte order", f);
+    if (h.version != SNAPVERSION)
+        die("%s: snapshot version %u, expected %d", f, h.version, SNAPVERSION);
+    if (h.hash != p->hash)
+    {
+        fclose(fp);
+        return -1;
+    }
+    if (h.nstk > (uint32_t)stacklimit || h.sp < 0 || (uint32_t)h.sp >= h.nstk || h.bp < 1 || (uint32_t)h.bp >= h.nstk)
+        die("%s: snapshot doesn't fit the stack", f);
+
+    if ((int)h.nstk > vm->stklen)
+        stkgrow(vm, h.nstk);
+    stk = vm->stk;
+    if (fread(stk, sizeof(stk[0]), h.nstk, fp) != h.nstk)
+        die("%s: truncated snapshot", f);
+    fclose(fp);
+
+    /* the frames, newest first, and the pc of the code
+       running in each to find its level with */
+    fb = emalloc(sizeof(fb[0]) * h.nstk);
+    fpc = emalloc(sizeof(fpc[0]) * h.nstk);
+    nf = 0;
+    pc = h.pc;
+    for (b = h.bp; b > 1; b = stk[b + 2])
+    {
+        if ((uint32_t)b + 3 >= h.nstk || stk[b + 2] >= b || fusedpc(p, pc) < 0)
+            die("%s: the frames in the snapshot don't add up", f);
+        fb[nf] = b;
+        fpc[nf++] = pc;
+        pc = stk[b + 3];
+        stk[b + 3] = fusedpc(p, pc);
+    }
+    if (fusedpc(p, pc) < 0)
+        die("%s: the frames in the snapshot don't add up", f);
+
+    /* the calls made them in this order, oldest first */
+    for (i = nf - 1; p->dmode && i >= 0; i--)
+    {
+        l = (fpc[i] < p->inslen) ? p->lev[fpc[i]] : -1;
+        if (l < 1 || l > MAX_LEXI_LEVEL)
+            die("%s: the frames in the snapshot don't add up", f);
+        vm->dsave[vm->depth++ & vm->dmask] = vm->display[l];
+        vm->display[l] = fb[i];
+    }
+    for (i = 0; vm->ar && i < nf; i++)
+        vm->ar[fb[i] - 1] = 1;
+
+    vm->sp = h.sp;
+    vm->bp = h.bp;
+    vm->pc = fusedpc(p, h.pc);
+    vm->oldpc = vm->pc;
+    vm->used = h.used;
+
+    free(fb);
+    free(fpc);
+    return 0;
+}
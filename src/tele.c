@@ -0,0 +1,247 @@
+#define _DEFAULT_SOURCE
+#include "dat.h"
+#include "fns.h"
+
+#ifdef __unix__
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+#endif
+
+#include <time.h>
+
+/* the telemetry, -o, the main machine publishes its counters in
+   shared memory named after its pid, /pl0.<pid>, and --top pid
+   maps them in and prints them every second while it runs
+
+   the machine runs a slice at a time like it does with -q, and
+   the counters get written between the slices, at most every
+   TELEMS, so the loops run like they always do and only pay for
+   stopping every SLICE instructions, the writer makes seq odd
+   before it writes and even after, a reader takes a copy and
+   takes it again if seq was odd or changed while it did */
+
+enum
+{
+    TELEVERSION = 1,
+    TELEMS      = 100,
+    TOPROWS     = 20
+};
+
+typedef struct
+{
+    char     magic[4];
+    uint32_t version;
+    uint32_t seq;
+    int32_t  done;
+
+    int64_t  retired;
+    int64_t  reads;
+    int64_t  writes;
+    int32_t  pc;
+    int32_t  stack;
+    int32_t  calls;
+    int32_t  pad;
+    double   ips;
+    double   ms;
+    char     name[64];
+} Tele;
+
+#ifdef __unix__
+static Tele *tele;
+static char shmname[32];
+static VM *tvm;
+static double start;
+static double last;
+static long long lastused;
+
+/* how many frames deep the machine is, out the dynamic links */
+static int calls(VM *vm)
+{
+    int bp, n;
+
+    n = 0;
+    for (bp = vm->bp; bp > 1 && bp + 2 < vm->stklen && vm->stk[bp + 2] < bp; bp = vm->stk[bp + 2])
+        n++;
+    return n;
+}
+
+/* write the counters of vm, only every TELEMS unless forced */
+void teleput(VM *vm, int force)
+{
+    Prog *p;
+    double now;
+
+    if (!tele)
+        return;
+    now = clockms(0);
+    if (!force && now - last < TELEMS)
+        return;
+
+    p = vm->prog;
+    __atomic_store_n(&tele->seq, tele->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    tele->retired = vm->used;
+    tele->reads = vm->nread;
+    tele->writes = vm->nwrite;
+    tele->pc = (vm->pc >= 0 && vm->pc < p->xlen) ? p->xsrc[vm->pc] : vm->pc;
+    tele->stack = vm->sp;
+    tele->calls = calls(vm);
+    if (now > last)
+        tele->ips = (vm->used - lastused) * 1e3 / (now - last);
+    tele->ms = now - start;
+    __atomic_store_n(&tele->seq, tele->seq + 1, __ATOMIC_RELEASE);
+
+    last = now;
+    lastused = vm->used;
+}
+
+/* a program that gets killed doesn't get to exit, take the
+   counters away before it goes */
+static void killed(int sig)
+{
+    shm_unlink(shmname);
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+/* start publishing the counters of vm */
+void teleopen(VM *vm)
+{
+    int fd;
+
+    snprintf(shmname, sizeof(shmname), "/pl0.%d", (int)getpid());
+    fd = shm_open(shmname, O_CREAT | O_TRUNC | O_RDWR, 0644);
+    if (fd < 0)
+        die("%s: %s", shmname, strerror(errno));
+    if (ftruncate(fd, sizeof(Tele)) < 0)
+        die("%s: %s", shmname, strerror(errno));
+    tele = mmap(NULL, sizeof(Tele), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (tele == MAP_FAILED)
+        die("%s: %s", shmname, strerror(errno));
+
+    memcpy(tele->magic, "PL0S", 4);
+    tele->version = TELEVERSION;
+    snprintf(tele->name, sizeof(tele->name), "%s", vm->prog->src ? vm->prog->src : "");
+    tvm = vm;
+    start = last = clockms(0);
+    lastused = 0;
+    teleput(vm, 1);
+    atexit(teleclose);
+    signal(SIGINT, killed);
+    signal(SIGTERM, killed);
+    signal(SIGHUP, killed);
+}
+
+/* the last counters, marked done, a program that dies in the
+   middle gets here from exit */
+void teleclose(void)
+{
+    if (!tele)
+        return;
+    teleput(tvm, 1);
+    __atomic_store_n(&tele->done, 1, __ATOMIC_RELEASE);
+    munmap(tele, sizeof(Tele));
+    shm_unlink(shmname);
+    tele = NULL;
+}
+
+/* a copy of the counters that was not being written */
+static void readtele(Tele *t, Tele *c)
+{
+    uint32_t s;
+
+    for (;;)
+    {
+        s = __atomic_load_n(&t->seq, __ATOMIC_ACQUIRE);
+        if (s & 1)
+        {
+            sched_yield();
+            continue;
+        }
+        memcpy(c, t, sizeof(*c));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&t->seq, __ATOMIC_RELAXED) == s)
+            return;
+    }
+}
+
+/* print the counters of the program running as pid every ms
+   until it ends */
+int teletop(int pid, int ms)
+{
+    struct timespec ts;
+    Tele *t, c;
+    char name[32];
+    int fd, n, done;
+
+    snprintf(name, sizeof(name), "/pl0.%d", pid);
+    fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0)
+        die("no pl0 -o running as pid %d", pid);
+    t = mmap(NULL, sizeof(Tele), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (t == MAP_FAILED)
+        die("%s: %s", name, strerror(errno));
+    if (memcmp(t->magic, "PL0S", 4) != 0 || t->version != TELEVERSION)
+        die("%s: not the counters of this version of pl0", name);
+
+    ms = max(ms, 1);
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (ms % 1000) * 1000000L;
+    for (n = 0;; n++)
+    {
+        readtele(t, &c);
+        done = c.done;
+        if (n % TOPROWS == 0)
+        {
+            printf("pid %d %s\n", pid, c.name);
+            printf("%10s %14s %14s %8s %8s %8s %8s %8s\n",
+                "s", "retired", "ips", "pc", "stack", "calls", "reads", "writes");
+        }
+        printf("%10.1f %14lld %14.0f %8d %8d %8d %8lld %8lld\n", c.ms / 1e3, (long long)c.retired,
+            c.ips, c.pc, c.stack, c.calls, (long long)c.reads, (long long)c.writes);
+        fflush(stdout);
+
+        if (done)
+            break;
+        if (kill(pid, 0) < 0 && errno == ESRCH)
+        {
+            printf("pid %d is gone\n", pid);
+            shm_unlink(name);
+            break;
+        }
+        nanosleep(&ts, NULL);
+    }
+
+    munmap(t, sizeof(Tele));
+    return 0;
+}
+#else
+void teleput(VM *vm, int force)
+{
+    (void)vm;
+    (void)force;
+}
+
+void teleopen(VM *vm)
+{
+    (void)vm;
+    die("-o needs shared memory");
+}
+
+void teleclose(void)
+{
+}
+
+int teletop(int pid, int ms)
+{
+    (void)pid;
+    (void)ms;
+    die("--top needs shared memory");
+    return 1;
+}
+#endif
@@ -0,0 +1,181 @@
+#include "dat.h"
+#include "fns.h"
+
+#include <pthread.h>
+
+/* the trace jit, the threaded loop for it counts how many times
+   every loop goes around at the jump back to its top, once one
+   does HOT times the next time around gets recorded, only the
+   pcs the conditional jumps went to since the rest of the way
+   follows from the code, and when it gets back to the top that
+   path gets compiled to machine code and run from there on, on
+   the same stack the loop was running on, every way off the
+   path is a exit back to the loop at the pc it would have gone to
+
+   a loop that can't be compiled, because it calls, reads, runs
+   into another loop or is too long, gets counted as never hot,
+   one that got left before it got recorded gets another try
+   later, this is for verified code using the display only */
+
+enum
+{
+    HOT       = 64,
+    MAXREC    = 256,
+    MAXPATH   = 1024,
+    MAXTRACES = 256
+};
+
+/* the code generator isn't reentrant, batch jobs on other
+   threads can be compiling their own loops */
+static pthread_mutex_t genlock = PTHREAD_MUTEX_INITIALIZER;
+
+Jit *newjit(int len)
+{
+    Jit *j;
+
+    j = emalloc(sizeof(*j));
+    j->count = emalloc(sizeof(j->count[0]) * (len + 1));
+    j->trace = emalloc(sizeof(j->trace[0]) * (len + 1));
+    j->path = emalloc(sizeof(j->path[0]) * MAXREC);
+    j->rec = -1;
+    return j;
+}
+
+void freejit(Jit *j, int len)
+{
+    int i;
+
+    for (i = 0; i <= len; i++)
+    {
+        if (j->trace[i])
+            tracefree(j->trace[i]);
+    }
+    free(j->count);
+    free(j->trace);
+    free(j->path);
+    free(j);
+}
+
+/* stop recording, the loop can get hot again after a while
+   unless never is set */
+static void giveup(Jit *j, int never)
+{
+    j->count[j->rec] = never ? -(1 << 30) : -4 * HOT;
+    j->rec = -1;
+}
+
+/* a conditional jump went to pc while recording */
+void tracebranch(Jit *j, int pc)
+{
+    if (j->npath >= MAXREC)
+    {
+        giveup(j, 1);
+        return;
+    }
+    j->path[j->npath++] = pc;
+}
+
+static int isbranch(int op)
+{
+    return op == XJPC || (op >= XJEQL && op <= XJGEQK);
+}
+
+/* turn the recording into the pcs of the instructions one time
+   around the loop, with the top at the end, -1 when it isn't
+   a path that closes the loop */
+static int follow(Prog *p, Jit *j, int top, int *path)
+{
+    Xins *ir;
+    int pc, n, nb;
+
+    n = 0;
+    nb = 0;
+    pc = top;
+    do
+    {
+        if (n >= MAXPATH || pc >= p->xlen)
+            return -1;
+        path[n++] = pc;
+        ir = &p->xins[pc];
+        if (isbranch(ir->op))
+        {
+            if (nb >= j->npath)
+                return -1;
+            pc = j->path[nb++];
+        }
+        else if (ir->op == XJMP)
+            pc = ir->m;
+        else
+            pc++;
+
+        /* a jump back to anywhere but the top is another loop */
+        if (pc <= path[n - 1] && pc != top)
+            return -1;
+    } while (pc != top);
+
+    path[n] = top;
+    return (nb == j->npath) ? n : -1;
+}
+
+static int run(VM *vm, Trace *t, int sp, long long *fuel)
+{
+    int (*fn)(int*, int*, int*, long long*);
+    long long n, left;
+    Exit *e;
+
+    n = max(1, *fuel / t->len);
+    left = n;
+    memcpy(&fn, &t->fn, sizeof(fn));
+    e = &t->exit[fn(vm->stk, vm->stk + sp, vm->display, &left)];
+
+    *fuel -= (n - left) * t->len + e->ran;
+    vm->sp = sp + e->sp;
+    return e->pc;
+}
+
+/* the jit loop jumped back to top with the stack at sp, returns
+   the pc to go on from when it ran a trace, with the fuel it
+   used taken off fuel and vm->sp set, or -1 when it didn't */
+int traceloop(VM *vm, int top, int sp, long long *fuel)
+{
+    Jit *j;
+    Trace *t;
+    int *path, n;
+
+    j = vm->jit;
+    if (j->trace[top])
+        return run(vm, j->trace[top], sp, fuel);
+
+    if (j->rec >= 0 && j->rec != top)
+        giveup(j, 0);
+    else if (j->rec == top)
+    {
+        path = emalloc(sizeof(path[0]) * (MAXPATH + 1));
+        n = follow(vm->prog, j, top, path);
+        t = NULL;
+        if (n > 0 && j->ntrace < MAXTRACES)
+        {
+            pthread_mutex_lock(&genlock);
+            t = tracegen(vm, path, n);
+            pthread_mutex_unlock(&genlock);
+        }
+        free(path);
+
+        if (!t)
+        {
+            giveup(j, 1);
+            return -1;
+        }
+        j->rec = -1;
+        j->trace[top] = t;
+        j->ntrace++;
+        return run(vm, t, sp, fuel);
+    }
+
+    if (++j->count[top] == HOT)
+    {
+        j->rec = top;
+        j->npath = 0;
+    }
+    return -1;
+}
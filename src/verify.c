@@ -0,0 +1,299 @@
+#include "dat.h"
+#include "fns.h"
+
+/* the bytecode verifier, it runs over the code when it gets
+   loaded and proves the code can't make the vm touch memory
+   outside of the stack or run outside of the code, so the
+   vm can run it without masking every access:
+
+   every instruction that can run decodes
+   jumps and calls stay inside the code, nothing runs off the end
+   every instruction has the same lexical level, procedure and
+   stack depth from every path that gets to it
+   L is never more than the nesting depth
+   nothing pops below the frame header of its procedure
+   LOD and STO stay inside the frame they use, STO never
+   writes over the static link, dynamic link or return pc
+
+   the stack depth is counted from bp - 1 and the largest one
+   the code can reach gets returned in top, CAL only has to check
+   there is that much room above the new frame, TCL reuses a
+   frame that already had it
+
+   division by 0 is still checked when it happens, as is
+   running out of stack when the procedures recurse
+*/
+
+typedef struct
+{
+    int len;
+    int *lev;
+    int *own;
+    int *dep;
+    int *par;
+    int *frame;
+    int *work, nwork;
+} Ver;
+
+static int pw(int v)
+{
+    return v & (MAX_CODE_LENGTH-1);
+}
+
+/* the code that doesn't verify still runs, on the checked vm,
+   so why only gets printed when asked for */
+static int loud;
+
+static int fail(int pc, char *why)
+{
+    if (loud)
+        fprintf(stderr, "vm: can't verify the code at pc %d: %s, using the checked vm\n", pc, why);
+    return -1;
+}
+
+/* the procedure L static links out of procedure p */
+static int anc(Ver *v, int p, int l)
+{
+    for (; l > 0; l--)
+        p = v->par[p];
+    return p;
+}
+
+/* pc gets reached with the given state, it has to match what
+   it was reached with before */
+static int flow(Ver *v, int from, int pc, int lev, int own, int dep)
+{
+    if (pc >= v->len)
+        return fail(from, "runs off the end of the code");
+
+    if (v->lev[pc] < 0)
+    {
+        v->lev[pc] = lev;
+        v->own[pc] = own;
+        v->dep[pc] = dep;
+        v->work[v->nwork++] = pc;
+        return 0;
+    }
+
+    if (v->lev[pc] != lev || v->own[pc] != own)
+        return fail(from, "jumps into another procedure");
+    if (v->dep[pc] != dep)
+        return fail(from, "the stack depth doesn't match at the jump target");
+    return 0;
+}
+
+int verify(Ins *ins, int len, int *top, int say)
+{
+    Ins *p;
+    Ver v;
+    int pc, op, lev, own, dep, pops, n, t, r;
+
+    loud = say;
+    memset(&v, 0, sizeof(v));
+    v.len = len;
+    v.lev = emalloc(sizeof(int) * (len + 1));
+    v.own = emalloc(sizeof(int) * (len + 1));
+    v.dep = emalloc(sizeof(int) * (len + 1));
+    v.par = emalloc(sizeof(int) * (len + 1));
+    v.frame = emalloc(sizeof(int) * (len + 1));
+    v.work = emalloc(sizeof(int) * (len + 1));
+
+    for (pc = 0; pc <= len; pc++)
+    {
+        v.lev[pc] = -1;
+        v.par[pc] = -1;
+        v.frame[pc] = -1;
+    }
+
+    *top = 0;
+    r = flow(&v, 0, 0, 0, 0, 0);
+    while (r == 0 && v.nwork > 0)
+    {
+        pc = v.work[--v.nwork];
+        p = &ins[pc];
+        op = decode(p);
+        lev = v.lev[pc];
+        own = v.own[pc];
+        dep = v.dep[pc];
+
+        /* how many values the instruction pops,
+           -1 for the ones that don't use the stack */
+        switch (op)
+        {
+            case XBAD:
+                r = fail(pc, "bad instruction");
+                continue;
+
+            case XRET:
+            case XINC:
+            case XJMP:
+            case XTCL:
+                pops = -1;
+                break;
+
+            case XLIT:
+            case XLOD:
+            case XSIO2:
+            case XCAL:
+                pops = 0;
+                break;
+
+            case XNEG:
+            case XODD:
+            case XSTO:
+            case XJPC:
+            case XSIO1:
+            case XLDS:
+                pops = 1;
+                break;
+
+            default:
+                pops = 2;
+                break;
+        }
+
+        if (pops >= 0)
+        {
+            if (dep < FRAME + pops)
+            {
+                r = fail(pc, "pops into the frame header");
+                continue;
+            }
+            if (v.frame[own] < 0 || dep < v.frame[own])
+                v.frame[own] = dep;
+        }
+
+        switch (op)
+        {
+            case XRET:
+                break;
+
+            case XJMP:
+                r = flow(&v, pc, pw(p->m), lev, own, dep);
+                break;
+
+            case XJPC:
+                r = flow(&v, pc, pw(p->m), lev, own, dep - 1);
+                if (r == 0)
+                    r = flow(&v, pc, pc + 1, lev, own, dep - 1);
+                break;
+
+            case XINC:
+                if (p->m < -dep || p->m >= MAX_STACK_HEIGHT - dep)
+                {
+                    r = fail(pc, "bad INC");
+                    break;
+                }
+                *top = max(*top, dep + p->m);
+                r = flow(&v, pc, pc + 1, lev, own, dep + p->m);
+                break;
+
+            case XLOD:
+            case XSTO:
+                if (p->l < 0 || p->l > lev)
+                    r = fail(pc, "L is deeper than the nesting");
+                else if (p->m < 0 || (op == XSTO && p->m > RA && p->m < FRAME))
+                    r = fail(pc, "bad frame offset");
+                else
+                {
+                    *top = max(*top, dep + 1);
+                    r = flow(&v, pc, pc + 1, lev, own, op == XLOD ? dep + 1 : dep - 1);
+                }
+                break;
+
+            case XCAL:
+                n = pw(p->m);
+                if (p->l < 0 || p->l > lev || lev - p->l + 1 > MAX_LEXI_LEVEL)
+                {
+                    r = fail(pc, "L is deeper than the nesting");
+                    break;
+                }
+                if (n >= len)
+                {
+                    r = fail(pc, "calls outside of the code");
+                    break;
+                }
+
+                t = anc(&v, own, p->l);
+                if (v.lev[n] < 0)
+                {
+                    v.par[n] = t;
+                    r = flow(&v, pc, n, lev - p->l + 1, n, 0);
+                }
+                else if (v.own[n] != n || v.par[n] != t || v.lev[n] != lev - p->l + 1)
+                    r = fail(pc, "calls something that isn't the same procedure");
+
+                *top = max(*top, dep + FRAME);
+                if (r == 0)
+                    r = flow(&v, pc, pc + 1, lev, own, dep);
+                break;
+
+            case XTCL:
+                n = pw(p->m);
+                if (p->l != 1 || lev < 1)
+                {
+                    r = fail(pc, "TCL to another level");
+                    break;
+                }
+                if (n >= len)
+                {
+                    r = fail(pc, "calls outside of the code");
+                    break;
+                }
+
+                t = anc(&v, own, 1);
+                if (v.lev[n] < 0)
+                {
+                    v.par[n] = t;
+                    r = flow(&v, pc, n, lev, n, 0);
+                }
+                else if (v.own[n] != n || v.par[n] != t || v.lev[n] != lev)
+                    r = fail(pc, "calls something that isn't the same procedure");
+                break;
+
+            case XSIO1:
+                r = flow(&v, pc, pc + 1, lev, own, dep - 1);
+                break;
+
+            case XLDS:
+                if (p->m < 0 || p->m >= MAX_STACK_HEIGHT - dep)
+                {
+                    r = fail(pc, "bad LDS");
+                    break;
+                }
+                *top = max(*top, dep + p->m);
+                r = flow(&v, pc, pc + 1, lev, own, dep - 1);
+                break;
+
+            default:
+                *top = max(*top, dep + 1);
+                r = flow(&v, pc, pc + 1, lev, own, dep - pops + 1);
+                break;
+        }
+    }
+
+    /* now that the frames are known, LOD and STO have to
+       stay below the lowest the stack gets in the frame they use */
+    for (pc = 0; r == 0 && pc < len; pc++)
+    {
+        p = &ins[pc];
+        op = decode(p);
+        if (v.lev[pc] < 0 || (op != XLOD && op != XSTO))
+            continue;
+
+        t = anc(&v, v.own[pc], p->l);
+        if (p->m >= v.frame[t])
+            r = fail(pc, "LOD or STO outside of the frame");
+    }
+
+    if (r == 0 && 1 + *top > MAX_STACK_HEIGHT)
+        r = fail(0, "the main program doesn't fit on the stack");
+
+    free(v.lev);
+    free(v.own);
+    free(v.dep);
+    free(v.par);
+    free(v.frame);
+    free(v.work);
+    return r;
+}
@@ -1,86 +1,737 @@
+#define _DEFAULT_SOURCE
 #include "dat.h"
 #include "fns.h"
 
-/* the vm data */
-static Ins ir;
-static int inslen;
-static Ins ins[MAX_CODE_LENGTH];
-static int stk[MAX_STACK_HEIGHT];
+#if defined(__GNUC__) && !defined(NOTHREAD)
+#define THREADED
+#endif
+
+#ifdef __unix__
+#include <sys/mman.h>
+#include <signal.h>
+#include <unistd.h>
+#endif
+
+#include <time.h>
+
+/* the code loaded last and the machine execute() runs it on,
+   the batch runner takes the code and runs it on machines
+   of its own */
+static Prog *cur;
+static VM *mainvm;
+static Code insbuf[MAX_CODE_LENGTH];
+
+/* the machine running on this thread, for the stack guard */
+#ifdef __GNUC__
+static __thread VM *running;
+#else
+static VM *running;
+#endif
+
+#ifdef VMSTATS
+long long ndispatch;
+#endif
+
+/* the display, the base of the newest frame of every lexical
+   level, with the entries CAL replaced so RET can put them back */
+#ifdef NODISPLAY
+enum { usedisplay = 0 };
+#else
+enum { usedisplay = 1 };
+#endif
+
+/* code that passes the verifier runs in the unchecked loops,
+   unless it is being traced */
+#ifdef NOVERIFY
+enum { useverify = 0 };
+#else
+enum { useverify = 1 };
+#endif
+
+#ifdef THREADED
+static void **runthreaded(VM*, int);
+static void **runthreadedfast(VM*, int);
+static void **runthreadedtos(VM*, int);
+static void **runthreadedjit(VM*, int);
+#endif
+
+/* a error in the program the machine runs */
+void vmdie(VM *vm, char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vfprintf(vm->err, fmt, ap);
+    fprintf(vm->err, "\n");
+    va_end(ap);
+
+    if (vm->jb)
+        longjmp(*vm->jb, 1);
+    exit(1);
+}
+
+/* something looks at every instruction the program runs, it
+   runs as it is in the loop that traces */
+static int tracing(void)
+{
+    return verbose || tracefile || profile;
+}
+
+/* the pc in the loaded code the running instruction came from */
+static int srcpc(VM *vm)
+{
+    Prog *p;
+
+    p = vm->prog;
+    if (vm->oldpc >= 0 && vm->oldpc < p->xlen)
+        return p->xsrc[vm->oldpc];
+    return p->inslen;
+}
+
+static void overflow(VM *vm)
+{
+    vmdie(vm, "vm: stack overflow at pc %d", srcpc(vm));
+}
+
+/* the words the stack gets, the power of 2 at or over the limit,
+   the jit and register vm mask their stack accesses with it */
+int stkspan(void)
+{
+    int n;
+
+    for (n = MAX_STACK_HEIGHT; n < stacklimit; n *= 2)
+        ;
+    return n;
+}
+
+#ifdef __unix__
+/* anything that gets past the checks into the guard or the
+   part of the mapping that isn't usable ends up here */
+static void guard(int sig, siginfo_t *si, void *uc)
+{
+    static const char msg[] = "vm: stack overflow\n";
+    char *a, buf[64];
+    VM *vm;
+    int n;
+
+    (void)uc;
+    vm = running;
+    a = si->si_addr;
+    if (!vm || a < (char*)(vm->stk + vm->stklen) || a >= (char*)vm->stk + vm->stkmap)
+    {
+        signal(sig, SIG_DFL);
+        return;
+    }
+
+    if (vm->oldpc < 0)
+        n = snprintf(buf, sizeof(buf), "%s", msg);
+    else
+        n = snprintf(buf, sizeof(buf), "vm: stack overflow at pc %d\n", srcpc(vm));
+    if (write(2, buf, n) < 0)
+        _exit(2);
+    _exit(1);
+}
+
+/* map the whole stack without any access, it gets made
+   usable a piece at a time, all of stkspan so whatever the jit
+   and register vm mask to is in it */
+static void stkinit(VM *vm)
+{
+    struct sigaction sa;
+    size_t page;
+
+    page = sysconf(_SC_PAGESIZE);
+    vm->stkmap = sizeof(int) * (size_t)stkspan() + page;
+    vm->stkmap = (vm->stkmap + page - 1) & ~(page - 1);
+
+    vm->stk = mmap(NULL, vm->stkmap, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (vm->stk == MAP_FAILED)
+        die("vm: mmap: %s", strerror(errno));
+    vm->stklen = 0;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = guard;
+    sa.sa_flags = SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGSEGV, &sa, NULL);
+    sigaction(SIGBUS, &sa, NULL);
+}
+
+static void stkfree(VM *vm)
+{
+    munmap(vm->stk, vm->stkmap);
+}
+
+/* make at least need words of the stack usable */
+void stkgrow(VM *vm, int need)
+{
+    int n;
+
+    if (need < 0 || need > stacklimit)
+        overflow(vm);
+
+    for (n = max(vm->stklen, STACK_CHUNK); n < need; n *= 2)
+        ;
+    n = min(n, stacklimit);
+
+    if (mprotect(vm->stk, sizeof(int) * (size_t)n, PROT_READ | PROT_WRITE) < 0)
+        die("vm: mprotect: %s", strerror(errno));
+    vm->stklen = n;
+}
+#else
+static void stkinit(VM *vm)
+{
+    vm->stk = emalloc(sizeof(int) * (size_t)stkspan());
+    vm->stklen = 0;
+}
+
+static void stkfree(VM *vm)
+{
+    free(vm->stk);
+}
+
+void stkgrow(VM *vm, int need)
+{
+    if (need < 0 || need > stacklimit)
+        overflow(vm);
+    vm->stklen = stacklimit;
+}
+#endif
+
+static int sw(VM *vm, int v)
+{
+    if ((unsigned)v >= (unsigned)vm->stklen)
+    {
+        if (v < 0)
+            vmdie(vm, "vm: stack underflow at pc %d", srcpc(vm));
+        stkgrow(vm, v + 1);
+    }
+    return v;
+}
+
+static int pw(int v)
+{
+    return v & (MAX_CODE_LENGTH-1);
+}
+
+/* make a machine, with a stack of its own */
+VM *newvm(void)
+{
+    VM *vm;
+    int n;
+
+    vm = emalloc(sizeof(*vm));
+    vm->in = stdin;
+    vm->out = stdout;
+    vm->err = stderr;
+
+    stkinit(vm);
+    stkgrow(vm, min(STACK_CHUNK, stacklimit));
+
+    /* every frame takes at least FRAME words of stack */
+    for (n = 1; n < stacklimit / FRAME + 1; n *= 2)
+        ;
+    vm->dsave = emalloc(sizeof(vm->dsave[0]) * n);
+    vm->dmask = n - 1;
+    return vm;
+}
+
+void freevm(VM *vm)
+{
+    stkfree(vm);
+    if (vm->jit)
+        freejit(vm->jit, vm->prog->xlen);
+    free(vm->dsave);
+    free(vm->ar);
+    free(vm);
+}
+
+/* get the machine ready to run p from the start, it can
+   have run something else before */
+void vmreset(VM *vm, Prog *p, FILE *in, FILE *out, FILE *err)
+{
+    /* the traces are of the code it ran */
+    if (vm->jit && vm->prog != p)
+    {
+        freejit(vm->jit, vm->prog->xlen);
+        vm->jit = NULL;
+    }
+
+    vm->prog = p;
+    vm->in = in;
+    vm->out = out;
+    vm->err = err;
+    vm->jb = NULL;
+
+    /* code can read a variable before it sets it, that
+       has to be 0 like on a fresh stack */
+    memset(vm->stk, 0, sizeof(vm->stk[0]) * vm->stklen);
+
+    vm->sp = 0;
+    vm->bp = 1;
+    vm->pc = 0;
+    vm->oldpc = 0;
+
+    memset(vm->display, 0, sizeof(vm->display));
+    vm->display[0] = vm->bp;
+    vm->depth = 0;
+
+    /* the activation records are only for tracing, a fresh
+       calloc costs nothing until the trace writes to it */
+    free(vm->ar);
+    vm->ar = NULL;
+    if (tracing())
+        vm->ar = emalloc(sizeof(vm->ar[0]) * max(stacklimit, MAX_STACK_HEIGHT));
+    vm->lastar = 0;
+
+    vm->halt = 0;
+    vm->used = 0;
+    vm->nread = 0;
+    vm->nwrite = 0;
+}
+
+/* a copy of a machine that has been running, with a stack of
+   its own, it runs the same code from where the other one is
+   and the files are the same until the caller changes them */
+VM *clonevm(VM *vm)
+{
+    VM *c;
+
+    c = newvm();
+    if (c->stklen < vm->stklen)
+        stkgrow(c, vm->stklen);
+    memcpy(c->stk, vm->stk, sizeof(c->stk[0]) * vm->stklen);
+    memcpy(c->dsave, vm->dsave, sizeof(c->dsave[0]) * (vm->dmask + 1));
+    memcpy(c->display, vm->display, sizeof(c->display));
+
+    c->prog = vm->prog;
+    c->sp = vm->sp;
+    c->bp = vm->bp;
+    c->pc = vm->pc;
+    c->oldpc = vm->oldpc;
+    c->halt = vm->halt;
+    c->used = vm->used;
+    c->nread = vm->nread;
+    c->nwrite = vm->nwrite;
+    c->depth = vm->depth;
+    c->in = vm->in;
+    c->out = vm->out;
+    c->err = vm->err;
+
+    if (vm->ar)
+    {
+        c->ar = emalloc(sizeof(c->ar[0]) * max(stacklimit, MAX_STACK_HEIGHT));
+        memcpy(c->ar, vm->ar, sizeof(c->ar[0]) * vm->stklen);
+    }
+    c->lastar = vm->lastar;
+    return c;
+}
+
+/* decode a instruction into the op the dispatch loops use */
+int decode(Ins *p)
+{
+    static const unsigned char ops[] =
+    {
+        [OLIT] = XLIT, [OLOD] = XLOD, [OSTO]  = XSTO,  [OCAL]  = XCAL,
+        [OINC] = XINC, [OJMP] = XJMP, [OJPC]  = XJPC,  [OSIO1] = XSIO1,
+        [OSIO2] = XSIO2, [OLDS] = XLDS, [OTCL] = XTCL
+    };
+
+    if (p->op == OOPR)
+    {
+        if (p->m < ORET || p->m > OGEQ)
+            return XBAD;
+        return XRET + p->m;
+    }
+
+    if (p->op <= 0 || p->op >= nelem(ops))
+        return XBAD;
+    return ops[p->op];
+}
+
+/* find the lexical level of every instruction that can run,
+   -1 for the ones that can't, the code has to agree with
+   itself on the levels or the display can't be used for it */
+static int levels(Ins *ins, int len, int *lev)
+{
+    Ins *p;
+    int *work, nwork, pc, l, n, i;
+    int succ[2], nsucc;
+
+    work = emalloc(sizeof(work[0]) * (len + 1));
+    nwork = 0;
+
+    for (i = 0; i < len; i++)
+        lev[i] = -1;
+
+    lev[0] = 0;
+    work[nwork++] = 0;
+    while (nwork > 0)
+    {
+        pc = work[--nwork];
+        p = &ins[pc];
+        l = lev[pc];
+        nsucc = 0;
+
+        switch (decode(p))
+        {
+            case XRET:
+            case XBAD:
+                break;
+
+            case XJMP:
+                succ[nsucc++] = pw(p->m);
+                break;
+
+            case XJPC:
+                succ[nsucc++] = pc + 1;
+                succ[nsucc++] = pw(p->m);
+                break;
+
+            case XCAL:
+                n = pw(p->m);
+                if (p->l > l || l - p->l + 1 > MAX_LEXI_LEVEL || n >= len)
+                    goto fail;
+                if (lev[n] < 0)
+                {
+                    lev[n] = l - p->l + 1;
+                    work[nwork++] = n;
+                }
+                else if (lev[n] != l - p->l + 1)
+                    goto fail;
+                succ[nsucc++] = pc + 1;
+                break;
+
+            case XTCL:
+                if (p->l != 1 || l < 1 || pw(p->m) >= len)
+                    goto fail;
+                succ[nsucc++] = pw(p->m);
+                break;
+
+            case XLOD:
+            case XSTO:
+                if (p->l > l)
+                    goto fail;
+                succ[nsucc++] = pc + 1;
+                break;
+
+            default:
+                succ[nsucc++] = pc + 1;
+                break;
+        }
+
+        for (i = 0; i < nsucc; i++)
+        {
+            n = succ[i];
+            if (n >= len)
+                continue;
+            if (lev[n] < 0)
+            {
+                lev[n] = l;
+                work[nwork++] = n;
+            }
+            else if (lev[n] != l)
+                goto fail;
+        }
+    }
+
+    free(work);
+    return 0;
+
+fail:
+    free(work);
+    return -1;
+}
+
+
+/* rewrite the fused code into the quickened ops, a LOD or STO
+   of the frame of the procedure it is in only needs bp, that is
+   L 0 or with the display the level of the code, L stays what it
+   was so the trace jit can still use the display for them */
+static void quicken(Prog *p)
+{
+    Xins *ir;
+    int i, lev, nvar, nlit;
+
+    nvar = nlit = 0;
+    for (i = 0; i < p->xlen; i++)
+    {
+        ir = &p->xins[i];
+        lev = p->dmode ? p->lev[p->xsrc[i]] : 0;
+        switch (ir->op)
+        {
+            case XLOD:
+                if (!p->dmode && ir->l == 0)
+                    ir->op = XLOD0;
+                break;
+
+            case XSTO:
+                if (!p->dmode && ir->l == 0)
+                    ir->op = XSTO0;
+                break;
+
+            case XLODD:
+                if (ir->l == lev)
+                    ir->op = XLOD0;
+                break;
+
+            case XSTOD:
+                if (ir->l == lev)
+                    ir->op = XSTO0;
+                break;
+
+            case XLIT:
+                if (ir->m == 0)
+                    ir->op = XLIT0;
+                else if (ir->m == 1)
+                    ir->op = XLIT1;
+                nlit += ir->op != XLIT;
+                break;
+        }
+        nvar += ir->op == XLOD0 || ir->op == XSTO0;
+    }
+
+    if (showfuse)
+        fprintf(stderr, "quicken: %d lod/sto of the frame, %d lit 0/1\n", nvar, nlit);
+}
+
+/* decode all of the loaded code ahead of time so the dispatch loops
+   don't have to, the threaded loop also gets the address
+   of the handler for every instruction
 
-static int sp;
-static int bp;
-static int pc;
-static int oldpc;
+   when the levels of the code are known, LOD, STO, CAL and RET
+   get turned into versions that go through the display, with L
+   being the level of the frame they use instead of how many
+   static links to follow to get to it
+*/
+static void predecode(Prog *p, int file)
+{
+    Ins *q, *d;
+    unsigned char *dec;
+    int *lev;
+    int i, n, len;
+#ifdef THREADED
+    void **labels;
+#endif
+
+    len = p->inslen;
+    p->wide = emalloc(sizeof(p->wide[0]) * (len + 1));
+    for (i = 0; i < len; i++)
+        unpack(p->ins[i], &p->wide[i]);
+    p->hash = fnv(2166136261u, p->wide, sizeof(p->wide[0]) * len);
+
+    p->verified = useverify && verify(p->wide, len, &p->top, file || verbose || showfuse) == 0;
+    p->fast = p->verified && !tracing() && !debugging;
+
+    d = emalloc(sizeof(d[0]) * (len + 1));
+    dec = emalloc(len + 1);
+    lev = p->lev = emalloc(sizeof(lev[0]) * (len + 1));
+
+    for (i = 0; i < len; i++)
+    {
+        d[i] = p->wide[i];
+        dec[i] = decode(&p->wide[i]);
+    }
 
-static int ar[MAX_STACK_HEIGHT];
-static int lastar;
+    /* tracing and the debugger show the code as it is */
+    p->dmode = 0;
+    if (usedisplay && !tracing() && !debugging && len > 0 && levels(p->wide, len, lev) == 0)
+        p->dmode = 1;
 
-static int halt;
+    for (i = 0; p->dmode && i < len; i++)
+    {
+        q = &d[i];
+        if (lev[i] < 0)
+            continue;
 
-/* reset the vm fields, not the stack or code data,
-   we want this to be able to run multiple runs if needed */
-static void reset(void)
+        switch (dec[i])
+        {
+            case XLOD: q->l = lev[i] - q->l; dec[i] = XLODD; break;
+            case XSTO: q->l = lev[i] - q->l; dec[i] = XSTOD; break;
+            case XCAL: q->l = lev[i] - q->l + 1; dec[i] = XCALD; break;
+            case XRET: q->l = lev[i]; dec[i] = XRETD; break;
+        }
+    }
+
+    p->xins = emalloc(sizeof(p->xins[0]) * (len + 1));
+    p->xsrc = emalloc(sizeof(p->xsrc[0]) * (len + 1));
+    p->sup = emalloc(sizeof(p->sup[0]) * (len / 2 + 1));
+    if (tracing() || debugging)
+    {
+        n = len;
+        for (i = 0; i < n; i++)
+        {
+            p->xins[i].l = d[i].l;
+            p->xins[i].m = d[i].m;
+            p->xins[i].op = (p->xins[i].l == d[i].l) ? dec[i] : XBAD;
+            p->xsrc[i] = i;
+        }
+    }
+    else
+        n = fuse(d, dec, len, p->xins, p->xsrc, p->sup, p->dmode);
+
+    /* the checked loops fetch anything past the end from here */
+    p->xins[n].op = XBAD;
+    p->xsrc[n] = len;
+    p->xlen = n;
+    quicken(p);
+
+#ifdef THREADED
+    if (!p->fast)
+        labels = runthreaded(NULL, 1);
+    else if (engine == ETOS)
+        labels = runthreadedtos(NULL, 1);
+    else if (engine == ETRACE && p->dmode)
+        labels = runthreadedjit(NULL, 1);
+    else
+        labels = runthreadedfast(NULL, 1);
+
+    p->hand = emalloc(sizeof(p->hand[0]) * (n + 1));
+    for (i = 0; i <= n; i++)
+        p->hand[i] = labels[p->xins[i].op];
+#endif
+
+    if (p->fast && engine == ECLOSURE)
+        p->cl = clcompile(p);
+
+    free(d);
+    free(dec);
+}
+
+static void freeprog(Prog *p)
 {
-    sp = 0;
-    bp = 1;
-    pc = 0;
-    oldpc = 0;
+    free(p->wide);
+    free(p->xins);
+    free(p->xsrc);
+    free(p->sup);
+    free(p->hand);
+    free(p->lev);
+    free(p->cl);
+    free(p->loc);
+    free(p->src);
+    free(p);
+}
 
-    memset(&ir, 0, sizeof(ir));
+/* make the code in ins the loaded code, file is set when it
+   was read from a file instead of compiled from source */
+static void load(Code *ins, int len, int file)
+{
+    Prog *p;
 
-    memset(ar, 0, sizeof(ar));
-    lastar = 0;
+    if (cur)
+        freeprog(cur);
 
-    halt = 0;
+    p = emalloc(sizeof(*p));
+    p->ins = ins;
+    p->inslen = len;
+    predecode(p, file);
+    cur = p;
+}
+
+/* hand the loaded code over to the caller, for
+   running it on machines of its own */
+Prog *takeprog(void)
+{
+    Prog *p;
+
+    p = cur;
+    cur = NULL;
+    return p;
+}
+
+/* give the loaded code the source position of every instruction
+   and the file they are in */
+void loadlines(Loc *loc, char *src)
+{
+    cur->loc = emalloc(sizeof(cur->loc[0]) * (cur->inslen + 1));
+    memcpy(cur->loc, loc, sizeof(cur->loc[0]) * cur->inslen);
+    cur->src = strdup(src);
+    if (!cur->src)
+        die("oom trying to load the lines");
+}
+
+/* read the lines after the code of a instruction file, a line
+   for every pc the position changes at */
+static void readlines(FILE *fp, char *file, char *src, int len)
+{
+    Loc *loc, l, next;
+    int pc, last;
+
+    loc = emalloc(sizeof(loc[0]) * (len + 1));
+    last = 0;
+    l.line = l.col = 0;
+    while (fscanf(fp, "%d %d %d", &pc, &next.line, &next.col) == 3)
+    {
+        if (pc < last || pc >= len)
+            die("%s: the lines are out of order or past the code", file);
+        for (; last < pc; last++)
+            loc[last] = l;
+        l = next;
+    }
+    for (; last < len; last++)
+        loc[last] = l;
+
+    loadlines(loc, src);
+    free(loc);
 }
 
 /* load instruction from a file, fails if the
-   instruction file exceeds the instruction buffer */
+   instruction file exceeds the instruction buffer,
+   a object file gets mapped in and run from where it is,
+   the source lines can come after the code */
 void loadinsfile(char *file)
 {
     FILE *fp;
-    Ins *p;
-    int i, j;
+    Code *ins;
+    Ins in;
+    char src[1024];
+    int i, j, len;
+
+    if (isobj(file))
+    {
+        ins = mapobj(file, &len);
+        load(ins, len, 1);
+        return;
+    }
 
     fp = fopen(file, "r");
     if (!fp)
         die("%s: %s", file, strerror(errno));
 
+    poolreset();
     for (i = 0; i < MAX_CODE_LENGTH; i++)
     {
-        p = &ins[i];
-        if (fscanf(fp, "%d %d %d", &p->op, &p->l, &p->m) != 3)
+        if (fscanf(fp, "%d %d %d", &in.op, &in.l, &in.m) != 3)
             break;
 
-        if (p->op <= 0 || p->l < 0)
-            die("%s: invalid op: %d %d %d", p->op, p->l, p->m);
+        if (in.op <= 0 || in.l < 0)
+            die("%s: invalid op: %d %d %d", file, in.op, in.l, in.m);
+        insbuf[i] = pack(&in);
     }
 
-    inslen = i;
+    len = i;
     if (i == MAX_CODE_LENGTH)
     {
         if (fscanf(fp, "%d %d %d", &j, &j, &j) == 3)
             die("%s: max code length exceeded", file);
 
-        inslen = i - 1;
+        len = i - 1;
     }
 
-    reset();
+    load(insbuf, len, 1);
+    if (fscanf(fp, " lines %1023s", src) == 1)
+        readlines(fp, file, src, len);
     fclose(fp);
 }
 
 /* loads instruction from a buffer, this happens when
    we parse the source file */
-void loadinsbuf(Ins *p, int len)
+void loadinsbuf(Code *p, int len)
 {
     if (len >= MAX_CODE_LENGTH)
         die("internal error: max code length exceeded");
 
-    memset(ins, 0, sizeof(ins));
-    memmove(ins, p, sizeof(ins[0]) * len);
-    inslen = len;
-
-    reset();
+    load(p, len, 0);
 }
 
 /* write instructions we generate, or read in to a file */
@@ -96,135 +747,192 @@ void writeinsfile(char *f)
         return;
     }
 
-    for (i = 0; i < inslen; i++)
-        fprintf(fp, "%d %d %d\n", ins[i].op, ins[i].l, ins[i].m);
+    for (i = 0; i < cur->inslen; i++)
+        fprintf(fp, "%d %d %d\n", cur->wide[i].op, cur->wide[i].l, cur->wide[i].m);
+
+    /* the source lines, only where they change */
+    for (i = 0; cur->loc && i < cur->inslen; i++)
+    {
+        if (i == 0)
+            fprintf(fp, "lines %s\n", cur->src);
+        if (i == 0 || cur->loc[i].line != cur->loc[i-1].line || cur->loc[i].col != cur->loc[i-1].col)
+            fprintf(fp, "%d %d %d\n", i, cur->loc[i].line, cur->loc[i].col);
+    }
 
     fclose(fp);
 }
 
-/* print instructions for running the vm */
-static void printins(int which)
+/* the same as a object file that -p can map back in */
+void writeobjfile(char *f)
+{
+    writeobj(f, cur->ins, cur->inslen);
+}
+
+/* the same as a C program, see aot.c */
+void writecfile(char *f)
+{
+    writec(f, cur);
+}
+
+/* the name of a op, NULL if there is no such op */
+char *opname(int op)
 {
     static char *ops[] =
     {
         "",
         "lit", "opr", "lod", "sto", "cal",
         "inc", "jmp", "jpc", "sio", "sio",
-        "lds"
+        "lds", "tcl"
     };
 
-    Ins *p;
+    if (op <= 0 || op >= nelem(ops))
+        return NULL;
+    return ops[op];
+}
+
+/* put ins over the instruction at pc of the code p runs, the
+   debugger sets its breakpoints with it, every loop fetches the
+   instruction from there each time it gets to it */
+void patchins(Prog *p, int pc, Xins *ins)
+{
+    p->xins[pc] = *ins;
+#ifdef THREADED
+    p->hand[pc] = runthreaded(NULL, 1)[ins->op];
+#endif
+}
+
+/* print instructions for running the vm */
+void printins(VM *vm, int which)
+{
+    static Ins zero;
+    Prog *p;
+    Ins *q;
+    FILE *out;
     int i, j;
 
-    if (halt || !verbose)
+    if (vm->halt || !verbose)
         return;
 
+    p = vm->prog;
+    out = vm->out;
     if (which == 0)
     {
-        printf("Instruction listing\n\n");
-        printf("Line\tOP\tL\tM\n");
-        for (i = 0; i < inslen; i++)
+        fprintf(out, "Instruction listing\n\n");
+        fprintf(out, "Line\tOP\tL\tM\n");
+        for (i = 0; i < p->inslen; i++)
         {
-            p = &ins[i];
-            if (p->op <= 0 || p->op >= nelem(ops))
-                fprintf(stderr, "invalid opcode: %d %s %d %d\n", i, ops[p->op], p->l, p->m);
+            q = &p->wide[i];
+            if (!opname(q->op))
+                fprintf(vm->err, "invalid opcode: %d %d %d %d\n", i, q->op, q->l, q->m);
             else
-                printf("%d\t%s\t%d\t%d\n", i, ops[p->op], p->l, p->m);
+                fprintf(out, "%d\t%s\t%d\t%d\n", i, opname(q->op), q->l, q->m);
         }
-        printf("\n\n");
-        printf("\t\t\t\tpc\tbp\tsp\tstack\n");
-        printf("Initial values\t\t\t%d\t%d\t%d\t%d\n", pc, bp, sp, 0);
+        fprintf(out, "\n\n");
+        fprintf(out, "\t\t\t\tpc\tbp\tsp\tstack\n");
+        fprintf(out, "Initial values\t\t\t%d\t%d\t%d\t%d\n", vm->pc, vm->bp, vm->sp, 0);
     }
     else if (which == 1)
     {
-        p = &ir;
-        if (p->op <= 0 || p->op >= nelem(ops))
-            fprintf(stderr, "invalid opcode: %d %d %d", p->op, p->l, p->m);
+        q = (vm->oldpc < p->inslen) ? &p->wide[vm->oldpc] : &zero;
+        if (!opname(q->op))
+            fprintf(vm->err, "invalid opcode: %d %d %d", q->op, q->l, q->m);
         else
-            printf("%d\t%s   %d   %d      ", oldpc, ops[p->op], p->l, p->m);
+            fprintf(out, "%d\t%s   %d   %d      ", vm->oldpc, opname(q->op), q->l, q->m);
 
-        printf("\t%d\t%d\t%d\t", pc, bp, sp);
-        if (sp == 0)
+        fprintf(out, "\t%d\t%d\t%d\t", vm->pc, vm->bp, vm->sp);
+        if (vm->sp == 0)
             j = 5;
         else
-            j = max(lastar, sp);
+            j = max(vm->lastar, vm->sp);
 
-        if (halt)
+        if (vm->halt)
             j = 0;
 
         for (i = 1; i <= j; i++)
         {
-            printf("%d ", stk[i]);
-            if (ar[i] && (i != j))
-                printf("| ");
+            fprintf(out, "%d ", vm->stk[i]);
+            if (vm->ar[i] && (i != j))
+                fprintf(out, "| ");
         }
-        printf("\n");
+        fprintf(out, "\n");
     }
 }
 
-static int sw(int v)
-{
-    return v & (MAX_STACK_HEIGHT-1);
-}
-
-static int pw(int v)
-{
-    return v & (MAX_CODE_LENGTH-1);
-}
-
 /* calculates the base */
-static int base(int l, int b)
+static int base(VM *vm, int l, int b)
 {
     int b1;
 
     b1 = b;
     while (l > 0)
     {
-        b1 = sw(stk[sw(b1 + 1)]);
+        b1 = sw(vm, vm->stk[sw(vm, b1 + 1)]);
         l--;
     }
     return b1;
 }
 
-static int pop(void)
+/* report a instruction that doesn't decode, or a jump out of the code */
+void badins(VM *vm)
 {
-    int v;
+    Prog *p;
+    Ins q;
+
+    p = vm->prog;
+    memset(&q, 0, sizeof(q));
+    if (vm->oldpc < p->xlen)
+        q = p->wide[p->xsrc[vm->oldpc]];
+    fprintf(vm->err, "vm: unknown instruction: OP: %d L: %d M: %d\n", q.op, q.l, q.m);
+}
 
-    v = stk[sp];
-    sp = sw(sp - 1);
-    return v;
+/* base for verified code, the static links are always good */
+static int ubase(int *stk, int l, int b)
+{
+    while (l > 0)
+    {
+        b = stk[b + 1];
+        l--;
+    }
+    return b;
 }
 
-/* reads number from a user */
-static int readnum(void)
+/* reads number from the input of the machine */
+int readin(VM *vm)
 {
     char buf[16], *p;
     int i, j, mul;
 
 loop:
-    printf("Enter a value to be placed on top of the stack: ");
-    if (!fgets(buf, sizeof(buf), stdin))
+    fprintf(vm->out, "Enter a value to be placed on top of the stack: ");
+    if (!fgets(buf, sizeof(buf), vm->in))
     {
-        fprintf(stderr, "Invalid input, try again\n");
+        if (feof(vm->in))
+            vmdie(vm, "vm: out of input");
+        fprintf(vm->err, "Invalid input, try again\n");
         goto loop;
     }
 
     i = 0;
     while ((p = strchr(buf, '\n')) == NULL)
     {
-        fgets(buf, sizeof(buf), stdin);
+        /* the last line doesn't need a newline */
+        if (feof(vm->in) || !fgets(buf, sizeof(buf), vm->in))
+        {
+            p = buf + strlen(buf);
+            break;
+        }
         i = 1;
     }
     if (i)
     {
-        fprintf(stderr, "Input too long, try again\n");
+        fprintf(vm->err, "Input too long, try again\n");
         goto loop;
     }
 
     *p = '\0';
     if (buf[0] == '\0')
     {
-        fprintf(stderr, "No input entered, try again\n");
+        fprintf(vm->err, "No input entered, try again\n");
         goto loop;
     }
 
@@ -242,198 +950,529 @@ loop:
     {
         if (j > MAX_DIGIT)
         {
-            fprintf(stderr, "Input too long, enter a shorter number\n");
+            fprintf(vm->err, "Input too long, enter a shorter number\n");
             goto loop;
         }
 
         if (!(('0' <= buf[i]) && (buf[i] <= '9')))
         {
-            fprintf(stderr, "Input contains non-numbered characters, try again\n");
+            fprintf(vm->err, "Input contains non-numbered characters, try again\n");
             goto loop;
         }
     }
 
+    vm->nread++;
     return atoi(p) * mul;
 }
 
-/* run the virtual machine until halt is reached,
-   either when the bp is 0 or less or an invalid
-   instruction happens, or any exception, such as dividing by 0
-*/
-void execute(void)
+/* for the jit and register vm, they run on the main machine */
+int readnum(void)
 {
-    int v;
+    return readin(mainvm);
+}
 
-    printins(0);
-    while (!halt)
+/* how the handlers get to the machine, the registers are
+   locals of the loop that SAVE puts back into vm, the loops
+   for verified code skip the masking and only make sure there
+   is enough stack for every new frame, the checked ones fetch
+   anything past the end of the code as the bad instruction there */
+#define REGS \
+    do { \
+        xins = vm->prog->xins; sup = vm->prog->sup; \
+        xlen = vm->prog->xlen; top = vm->prog->top; \
+        stk = vm->stk; sp = vm->sp; bp = vm->bp; pc = vm->pc; \
+        fuel = vm->fuel; mark = pc; \
+    } while (0)
+#define SAVE \
+    do { vm->sp = sp; vm->bp = bp; vm->pc = pc; vm->fuel = fuel; } while (0)
+#define TRACE      do { SAVE; if (tracefile) ringput(vm); if (profile) profput(vm); printins(vm, 1); } while (0)
+#define AT(x)      (UNCHECKED ? (x) : min(x, xlen))
+#define SW(x)      (UNCHECKED ? (x) : sw(vm, x))
+#define PW(x)      (UNCHECKED ? (x) : pw(x))
+#define POP()      (UNCHECKED ? stk[sp--] : (t = stk[sp], sp = sw(vm, sp - 1), t))
+#define BASE(l, b) (UNCHECKED ? ubase(stk, l, b) : base(vm, l, b))
+#define ROOM \
+    do { if (UNCHECKED && bp + top > vm->stklen) stkgrow(vm, bp + top); } while (0)
+#define TOP        stk[sp]
+#define PUSH(x)    do { sp = SW(sp + 1); stk[sp] = (x); } while (0)
+#define DROP       (sp = SW(sp - 1))
+#define SPILL      ((void)0)
+#define FILL       ((void)0)
+
+/* the fuel gets charged for the instructions run since mark, where
+   pc went last, at every instruction that can change where it
+   goes, when it runs out the machine stops where it is, with
+   everything back in vm, and runvm can go on from there */
+#define RAN        (vm->oldpc - mark + 1)
+#define CHARGE \
+    do { \
+        fuel -= RAN; mark = pc; \
+        if (fuel <= 0) { if (TRACING) TRACE; YIELD; } \
+    } while (0)
+#define RECORD     ((void)0)
+#define LOOP       ((void)0)
+
+/* the switch dispatch loops, they only need standard C
+   so they are always there for compilers that lack computed goto */
+#define OP(x) case x:
+#define NEXT  break
+#define HALT  do { fuel -= RAN; SAVE; return; } while (0)
+#define YIELD do { SPILL; SAVE; return; } while (0)
+
+static void runswitch(VM *vm)
+{
+    Xins ir, *xins;
+    Sup *s, *sup;
+    int *stk, sp, bp, pc, top, xlen, mark;
+    int v, t;
+    long long fuel;
+
+#define UNCHECKED 0
+#define TRACING   0
+    REGS;
+    for (;;)
     {
-        ir = ins[pc];
-        oldpc = pc;
-        pc = pw(pc + 1);
+        vm->oldpc = pc;
+        ir = xins[AT(pc)];
+        pc = PW(pc + 1);
+        COUNT;
         switch (ir.op)
         {
-            case 1: /* LIT 0, M */
-                sp = sw(sp + 1);
-                stk[sp] = ir.m;
-                break;
+#include "exec.h"
+        }
+    }
+#undef UNCHECKED
+#undef TRACING
+}
 
-            case 2: /* OPR 0, M */
-                switch (ir.m)
-                {
-                    case 0: /* RET */
-                        ar[sw(bp - 1)] = 0;
-
-                        sp = sw(bp - 1);
-                        pc = stk[sw(sp + 4)];
-                        bp = stk[sw(sp + 3)];
-
-                        lastar = sw(bp + FRAME);
-
-                        if (sp <= 0)
-                        {
-                            lastar = 0;
-                            printins(1);
-                            halt = 1;
-                        }
-
-                        break;
-
-                    case 1: /* NEG */
-                        stk[sp] = -stk[sp];
-                        break;
-
-                    case 2: /* ADD */
-                        v = pop();
-                        stk[sp] += v;
-                        break;
-
-                    case 3: /* SUB */
-                        v = pop();
-                        stk[sp] -= v;
-                        break;
-
-                    case 4: /* MUL */
-                        v = pop();
-                        stk[sp] *= v;
-                        break;
-
-                    case 5: /* DIV */
-                        v = pop();
-                        if (v == 0)
-                            die("vm: divide by 0");
-                        stk[sp] /= v;
-                        break;
-
-                    case 6: /* ODD */
-                        stk[sp] %= 2;
-                        break;
-
-                    case 7: /* MOD */
-                        v = pop();
-                        if (v == 0)
-                            die("vm: mod by 0");
-                        stk[sp] %= v;
-                        break;
-
-                    case 8: /* EQL */
-                        v = pop();
-                        stk[sp] = (stk[sp] == v);
-                        break;
-
-                    case 9: /* NEQ */
-                        v = pop();
-                        stk[sp] = (stk[sp] != v);
-                        break;
-
-                    case 10: /* LSS */
-                        v = pop();
-                        stk[sp] = (stk[sp] < v);
-                        break;
-
-                    case 11: /* LEQ */
-                        v = pop();
-                        stk[sp] = (stk[sp] <= v);
-                        break;
-
-                    case 12: /* GTR */
-                        v = pop();
-                        stk[sp] = (stk[sp] > v);
-                        break;
-
-                    case 13: /* GEQ */
-                        v = pop();
-                        stk[sp] = (stk[sp] >= v);
-                        break;
-
-                    default:
-                        fprintf(stderr, "vm: unknown instruction: OP: %d L: %d M: %d\n", ir.op, ir.l, ir.m);
-                        halt = 1;
-                        break;
-                }
-                break;
+/* the only loop that traces, for -v and -g, the others have
+   it compiled out so it costs them nothing */
+static void runswitchtrace(VM *vm)
+{
+    Xins ir, *xins;
+    Sup *s, *sup;
+    int *stk, sp, bp, pc, top, xlen, mark;
+    int v, t;
+    long long fuel;
+
+#define UNCHECKED 0
+#define TRACING   1
+    REGS;
+    for (;;)
+    {
+        vm->oldpc = pc;
+        ir = xins[AT(pc)];
+        pc = PW(pc + 1);
+        COUNT;
+        switch (ir.op)
+        {
+#include "exec.h"
+        }
 
-            case 3: /* LOD L, M */
-                sp = sw(sp + 1);
-                stk[sp] = stk[sw(base(ir.l, bp) + ir.m)];
-                break;
+        if (TRACING)
+            TRACE;
+    }
+#undef UNCHECKED
+#undef TRACING
+}
 
-            case 4: /* STO L, M */
-                stk[sw(base(ir.l, bp) + ir.m)] = stk[sp];
-                sp = sw(sp - 1);
-                break;
+static void runswitchfast(VM *vm)
+{
+    Xins ir, *xins;
+    Sup *s, *sup;
+    int *stk, sp, bp, pc, top, xlen, mark;
+    int v, t;
+    long long fuel;
+
+#define UNCHECKED 1
+#define TRACING   0
+    REGS;
+    for (;;)
+    {
+        vm->oldpc = pc;
+        ir = xins[AT(pc)];
+        pc++;
+        COUNT;
+        switch (ir.op)
+        {
+#include "exec.h"
+        }
+    }
+#undef UNCHECKED
+#undef TRACING
+}
 
-            case 5: /* CAL L, M */
-                stk[sw(sp + 1)] = 0;
-                stk[sw(sp + 2)] = base(ir.l, bp);
-                stk[sw(sp + 3)] = bp;
-                stk[sw(sp + 4)] = pc;
-                bp = sw(sp + 1);
-                pc = pw(ir.m);
+#undef OP
+#undef NEXT
+#undef HALT
+#undef YIELD
+
+#ifdef THREADED
+/* labels as values and goto * are gnu extensions */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+
+/* the direct threaded loop, every instruction jumps straight
+   to the handler of the next one through the hand table,
+   calling it with init set returns the handler labels so
+   predecode can fill the table in when code gets loaded */
+static void **runthreaded(VM *vm, int init)
+{
+#define X(x) [x] = &&L##x,
+    static void *labels[NXOP] = { XOPS };
+#undef X
+
+    Xins ir, *xins;
+    Sup *s, *sup;
+    void **hand;
+    int *stk, sp, bp, pc, top, xlen, mark;
+    int v, t;
+    long long fuel;
+
+    if (init)
+        return labels;
+
+#define OP(x) L##x:
+#define NEXT  do { if (TRACING) TRACE; DISPATCH; } while (0)
+#define HALT  do { fuel -= RAN; SAVE; return NULL; } while (0)
+#define YIELD do { SPILL; SAVE; return NULL; } while (0)
+#define DISPATCH \
+    do { vm->oldpc = pc; ir = xins[AT(pc)]; pc = PW(pc + 1); COUNT; goto *hand[AT(vm->oldpc)]; } while (0)
+
+#define UNCHECKED 0
+#define TRACING   0
+    REGS;
+    hand = vm->prog->hand;
+    DISPATCH;
+#include "exec.h"
+#undef UNCHECKED
+#undef TRACING
+}
 
-                if (bp <= 0)
-                    halt = 1;
+/* the same for verified code */
+static void **runthreadedfast(VM *vm, int init)
+{
+#define X(x) [x] = &&L##x,
+    static void *labels[NXOP] = { XOPS };
+#undef X
+
+    Xins ir, *xins;
+    Sup *s, *sup;
+    void **hand;
+    int *stk, sp, bp, pc, top, xlen, mark;
+    int v, t;
+    long long fuel;
+
+    if (init)
+        return labels;
+
+#define UNCHECKED 1
+#define TRACING   0
+    REGS;
+    hand = vm->prog->hand;
+    DISPATCH;
+#include "exec.h"
+#undef UNCHECKED
+#undef TRACING
+}
 
-                ar[sw(bp - 1)] = 1;
-                lastar = sw(sp + FRAME);
-                break;
+/* the same again with the top of the stack kept in tos instead
+   of stk[sp], so the ops pop one operand from memory and push
+   nothing back, stk[sp] is only good after a SPILL, which the
+   handlers that use the stack in memory, calls and the
+   superinstructions on variables, do first */
+static void **runthreadedtos(VM *vm, int init)
+{
+#define X(x) [x] = &&L##x,
+    static void *labels[NXOP] = { XOPS };
+#undef X
+
+    Xins ir, *xins;
+    Sup *s, *sup;
+    void **hand;
+    int *stk, sp, bp, pc, top, xlen, mark;
+    int v, t, tos;
+    long long fuel;
+
+    if (init)
+        return labels;
+
+#undef TOP
+#undef PUSH
+#undef POP
+#undef DROP
+#undef SPILL
+#undef FILL
+#define TOP      tos
+#define PUSH(x)  do { stk[sp++] = tos; tos = (x); } while (0)
+#define POP()    (t = tos, tos = stk[--sp], t)
+#define DROP     (tos = stk[--sp])
+#define SPILL    (stk[sp] = tos)
+#define FILL     (tos = stk[sp])
+
+#define UNCHECKED 1
+#define TRACING   0
+    REGS;
+    hand = vm->prog->hand;
+    FILL;
+    DISPATCH;
+#include "exec.h"
+#undef UNCHECKED
+#undef TRACING
+}
 
-            case 6: /* INC 0, M */
-                sp = sw(sp + ir.m);
-                break;
+/* the same as the fast loop, but it watches the loops for the
+   trace jit and runs the ones it compiled, a trace leaves
+   everything in memory and the fuel taken off for what it ran */
+static void **runthreadedjit(VM *vm, int init)
+{
+#define X(x) [x] = &&L##x,
+    static void *labels[NXOP] = { XOPS };
+#undef X
+
+    Xins ir, *xins;
+    Sup *s, *sup;
+    void **hand;
+    int *stk, sp, bp, pc, top, xlen, mark;
+    int v, t;
+    long long fuel;
+
+    if (init)
+        return labels;
+
+#undef TOP
+#undef PUSH
+#undef POP
+#undef DROP
+#undef SPILL
+#undef FILL
+#undef RECORD
+#undef LOOP
+#define TOP        stk[sp]
+#define PUSH(x)    do { sp = SW(sp + 1); stk[sp] = (x); } while (0)
+#define POP()      (UNCHECKED ? stk[sp--] : (t = stk[sp], sp = sw(vm, sp - 1), t))
+#define DROP       (sp = SW(sp - 1))
+#define SPILL      ((void)0)
+#define FILL       ((void)0)
+#define RECORD \
+    do { if (vm->jit->rec >= 0) tracebranch(vm->jit, pc); } while (0)
+#define LOOP \
+    do { \
+        if (pc <= vm->oldpc && (t = traceloop(vm, pc, sp, &fuel)) >= 0) \
+        { \
+            sp = vm->sp; pc = t; mark = pc; \
+            if (fuel <= 0) YIELD; \
+        } \
+    } while (0)
+
+#define UNCHECKED 1
+#define TRACING   0
+    REGS;
+    hand = vm->prog->hand;
+    DISPATCH;
+#include "exec.h"
+#undef UNCHECKED
+#undef TRACING
+}
 
-            case 7: /* JMP 0, M */
-                pc = pw(ir.m);
-                break;
+#undef OP
+#undef NEXT
+#undef HALT
+#undef YIELD
+#undef DISPATCH
+
+#pragma GCC diagnostic pop
+#endif
+
+/* run the machine on the stack vm with the best dispatch loop we
+   have, for at most about fuel instructions, it returns 1 when
+   the program ended and 0 when the fuel ran out first, what is
+   left of the fuel is in vm->fuel, vm->used adds up what got
+   used and running it again goes on from where it stopped */
+int runvm(VM *vm, long long fuel)
+{
+    Prog *p;
+
+    p = vm->prog;
+    running = vm;
+    vm->fuel = fuel;
+    vm->oldpc = max(vm->oldpc, 0);
+    if (p->fast && 1 + p->top > vm->stklen)
+        stkgrow(vm, 1 + p->top);
+
+    if (tracing())
+        runswitchtrace(vm);
+    else if (p->cl)
+        runclosure(vm);
+    else
+#ifdef THREADED
+    if (engine != ESWITCH)
+    {
+        if (p->fast && engine == ETOS)
+            runthreadedtos(vm, 0);
+        else if (p->fast && engine == ETRACE && p->dmode)
+        {
+            if (!vm->jit)
+                vm->jit = newjit(p->xlen);
+            runthreadedjit(vm, 0);
+        }
+        else if (p->fast)
+            runthreadedfast(vm, 0);
+        else
+            runthreaded(vm, 0);
+    }
+    else
+#endif
+    if (p->fast)
+        runswitchfast(vm);
+    else
+        runswitch(vm);
+
+    vm->used += fuel - vm->fuel;
+    return vm->halt;
+}
 
-            case 8: /* JPC 0, M */
-                if (stk[sp] == 0)
-                    pc = pw(ir.m);
-                sp = sw(sp - 1);
+/* the time in ms, of the cpu this thread used when cpu is set */
+double clockms(int cpu)
+{
+    struct timespec ts;
 
-                break;
+    clock_gettime(cpu ? CLOCK_THREAD_CPUTIME_ID : CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
 
-            case 9: /* SIO 0, 1 */
-                printf("Value on top of the stack: %d\n", stk[sp]);
-                sp = sw(sp - 1);
-                break;
+/* run the main machine a slice at a time, to stop it when
+   it goes over the quota or the timeout and to checkpoint it */
+static void runlimited(VM *vm)
+{
+    long long n, left;
+    double start;
 
-            case 10: /* SIO 0, 2 */
-                sp = sw(sp + 1);
-                v = readnum();
-                stk[sp] = v;
-                break;
+    start = clockms(0);
+    left = ckpt;
+    for (;;)
+    {
+        n = SLICE;
+        if (quota > 0)
+            n = min(n, quota - vm->used);
+        if (ckpt > 0)
+            n = min(n, left);
+        if (runvm(vm, n))
+            return;
+        teleput(vm, 0);
+
+        if (ckpt > 0 && (left -= n - vm->fuel) <= 0)
+        {
+            savesnap(vm, snapfile);
+            left = ckpt;
+        }
+        if (quota > 0 && vm->used >= quota)
+            vmdie(vm, "vm: out of fuel after %lld instructions", vm->used);
+        if (timeout > 0 && clockms(0) - start >= timeout)
+            vmdie(vm, "vm: timed out after %d ms", timeout);
+    }
+}
 
-            case 11: /* LDS 0, M */
-                stk[sw(sp + ir.m)] = stk[sp];
-                sp = sw(sp - 1);
-                break;
+/* the jit and register vm mask their stack accesses with
+   stkspan, so they get all of the limit up front and any
+   overflow past it hits the guard, the split stack vm doesn't
+   grow it either */
+static void runother(VM *vm, Prog *p)
+{
+    stkgrow(vm, stacklimit);
+    vm->oldpc = -1;
 
-            default:
-                fprintf(stderr, "vm: unknown instruction: OP: %d L: %d M: %d\n", ir.op, ir.l, ir.m);
-                halt = 1;
-                break;
+    if (engine == EJIT)
+    {
+        if (jitcompile(p->wide, p->inslen, p->verified ? p->top : 0) == 0)
+            jitexec(vm->stk);
+        else
+        {
+            fprintf(stderr, "vm: code can't be compiled by the jit, using the stack vm\n");
+            runvm(vm, NOFUEL);
         }
+    }
+    else if (engine == ESPLIT)
+    {
+        if (ctlexec(vm, p) < 0)
+        {
+            fprintf(stderr, "vm: code can't run with a control stack, using the stack vm\n");
+            runvm(vm, NOFUEL);
+        }
+    }
+    else
+    {
+        if (regtrans(p->wide, p->inslen, p->verified ? p->top : 0) == 0)
+            regexec(vm->stk);
+        else
+        {
+            fprintf(stderr, "vm: code can't be translated to registers, using the stack vm\n");
+            runvm(vm, NOFUEL);
+        }
+    }
+}
+
+/* run the virtual machine until halt is reached,
+   either when the bp is 0 or less or an invalid
+   instruction happens, or any exception, such as dividing by 0
+*/
+void execute(void)
+{
+    Prog *p;
+
+    p = cur;
+    if (!mainvm)
+        mainvm = newvm();
+    vmreset(mainvm, p, stdin, stdout, stderr);
+    running = mainvm;
+    if (resume && loadsnap(mainvm, snapfile) < 0)
+        die("%s: the snapshot is of some other code", snapfile);
 
-        printins(1);
+    printins(mainvm, 0);
+
+    /* the trace has the stack worked out from the start */
+    if (tracefile)
+    {
+        if (resume)
+            die("-g can't trace a run that goes on from a snapshot");
+        ringopen(tracefile, p);
+    }
+    if (profile)
+    {
+        if (resume)
+            die("--profile can't profile a run that goes on from a snapshot");
+        profopen(profile, p);
+    }
+    if (heatmap)
+    {
+        if (resume)
+            die("--sample can't sample a run that goes on from a snapshot");
+        sampleopen(mainvm);
+    }
+    if (telemetry)
+        teleopen(mainvm);
+
+    /* anything that stops the machine part way needs the stack
+       vm, and so does tracing and debugging, the counters of -o
+       get written between the slices */
+    if (debugging)
+    {
+        if (resume)
+            die("-i can't debug a run that goes on from a snapshot");
+        debug(mainvm);
     }
+    else if (quota > 0 || timeout > 0 || ckpt > 0 || resume || telemetry)
+        runlimited(mainvm);
+    else if ((engine == EJIT || engine == EREG || engine == ESPLIT) && !tracing())
+        runother(mainvm, p);
+    else
+        runvm(mainvm, NOFUEL);
+    ringclose();
+    profclose();
+    sampleclose();
+    teleclose();
+
+#ifdef VMSTATS
+    fprintf(stderr, "vm: %lld instructions dispatched\n", ndispatch);
+#endif
 }
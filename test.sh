@@ -1,14 +1,152 @@
 #!/bin/bash
 
 bash build.sh
+
+# run everything on every engine, read_write.pl0 reads a number so feed it one
+for e in - -s -r -j -x -n -a
+do
+    for i in input/*.pl0
+    do
+        echo 5 | ./pl0 $e $i > /dev/null
+        if [[ "$?" != "0" ]]
+        then
+            echo "test failed:" "$e" "$i"
+            exit 1
+        fi
+    done
+done
+
+# tail calls reuse the frame, so deep ones still fit in a small stack
+for e in - -s -t -r -j -x -n -a
+do
+    if ! ./pl0 $e -m 64 input/tail_call.pl0 > /dev/null
+    then
+        echo "test failed:" "$e" tail calls
+        exit 1
+    fi
+done
+
+tmp=$(mktemp -d)
+
+# recursion too deep for the default stack fits in a bigger -m
+cat > $tmp/deep.pl0 << 'EOF'
+int n;
+procedure f();
+begin
+    if n > 0 then
+    begin
+        n := n - 1;
+        call f();
+    end;
+end;
+begin
+    n := 99999;
+    call f();
+end.
+EOF
+for e in - -s -t -r -j -x -n -a
+do
+    if ! ./pl0 $e -m 1000000 $tmp/deep.pl0 > /dev/null
+    then
+        echo "test failed:" "$e" -m
+        rm -rf $tmp
+        exit 1
+    fi
+done
+
+# a binary trace has to decode to what -v prints
+for i in input/*.pl0
+do
+    echo 5 | ./pl0 -v $i 2>/dev/null | sed -n '/^Instruction listing/,$p' > $tmp/v.out
+    echo 5 | ./pl0 -g $tmp/trace $i > /dev/null 2>&1
+    ./pl0 --decode $tmp/trace > $tmp/g.out 2>/dev/null
+    if ! cmp -s $tmp/v.out $tmp/g.out
+    then
+        echo "test failed:" -g "$i"
+        rm -rf $tmp
+        exit 1
+    fi
+done
+
+# the profile has to run the program the same and every instruction
+# it counted has to be in the stacks once
+for i in input/*.pl0
+do
+    echo 5 | ./pl0 $i > $tmp/vm.out 2>&1
+    echo 5 | ./pl0 --profile $tmp/stacks $i > $tmp/p.out 2> $tmp/report
+    n=$(awk '{ n += $NF } END { print n }' $tmp/stacks)
+    if ! cmp -s $tmp/vm.out $tmp/p.out || ! grep -q "^profile: $n instructions" $tmp/report
+    then
+        echo "test failed:" --profile "$i"
+        rm -rf $tmp
+        exit 1
+    fi
+done
+
+# the lines go through a instruction file, and the heat map has
+# every line of the source, with the samples next to the hot ones
+./pl0 -d input/bench/nest.pl0 $tmp/nest.txt > /dev/null
+./pl0 -p -d $tmp/nest.txt $tmp/nest2.txt > /dev/null
+./pl0 --sample $tmp/heat -p $tmp/nest.txt > /dev/null
+if ! cmp -s $tmp/nest.txt $tmp/nest2.txt ||
+   [[ "$(sed 1,2d $tmp/heat | wc -l)" != "$(wc -l < input/bench/nest.pl0)" ]] ||
+   ! grep -q '%.* 19  ' $tmp/heat
+then
+    echo "test failed:" --sample
+    rm -rf $tmp
+    exit 1
+fi
+
+# --top follows a program run with -o until it ends, this one waits
+# for its input so it is still running when --top gets to it
+mkfifo $tmp/in
+./pl0 -o input/read_write.pl0 < $tmp/in > /dev/null &
+pid=$!
+exec 3> $tmp/in
+for i in $(seq 50)
+do
+    [[ -e /dev/shm/pl0.$pid ]] && break
+    sleep 0.1
+done
+(sleep 0.3; echo 5 >&3) &
+./pl0 --top $pid 100 > $tmp/top
+exec 3>&-
+wait
+if [[ "$(tail -1 $tmp/top | awk '{ print $7, $8 }')" != "1 1" ]]
+then
+    echo "test failed:" -o
+    rm -rf $tmp
+    exit 1
+fi
+
+# the debugger has to stop where it was told to, in every loop
+for e in - -s -t
+do
+    out=$(printf 'b fact\nc\nw v\nd fact\nc\nbt\nc\nc\nc\nc\n' | ./pl0 -i $e input/recursive_factorial.pl0)
+    if ! echo "$out" | grep -q '^v changed from 1 to 2$' ||
+       ! echo "$out" | grep -q '^#4 main at pc' ||
+       [[ "$(echo "$out" | grep -c '^Value on top of the stack')" != "5" ]]
+    then
+        echo "test failed:" -i "$e"
+        rm -rf $tmp
+        exit 1
+    fi
+done
+
+# the C backend has to print exactly what the vm does
 for i in input/*.pl0
 do
-    ./pl0 $i 
-    if [[ "$?" != "0" ]]
+    echo 5 | ./pl0 $i > $tmp/vm.out 2>&1
+    echo 5 | ./pl0 -e $i $tmp/prog.c > /dev/null 2>&1
+    cc -O2 -pthread -o $tmp/prog $tmp/prog.c &&
+        echo 5 | $tmp/prog > $tmp/c.out 2>&1
+    if ! cmp -s $tmp/vm.out $tmp/c.out
     then
-        echo "test failed:" "$i"
+        echo "test failed:" -e "$i"
+        rm -rf $tmp
         exit 1
     fi
 done
+rm -rf $tmp
 
 echo "All test passes"